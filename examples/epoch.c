@@ -0,0 +1,54 @@
+#include <stdio.h>
+#include <pthread.h>
+#define TR24_IMPL
+#include "../tr24_smartptr.h"
+#include "../tr24_epoch.h"
+
+typedef struct {
+    int version;
+    int limit;
+} config_t;
+
+static config_t *volatile current;
+
+void cleanup(void *ptr, void *meta)
+{
+    (void)meta;
+    printf("releasing config %d\n", ((config_t *)ptr)->version);
+}
+
+void *reader(void *arg)
+{
+    (void)arg;
+    long sum = 0;
+    for(int i = 0; i < 100000; ++i) {
+        /* no reference counts are touched in here */
+        tr24_epoch_enter();
+        config_t *cfg = tr24_epoch_load(&current);
+        sum += cfg->limit;
+        tr24_epoch_exit();
+    }
+    printf("reader done %ld\n", sum);
+    return NULL;
+}
+
+int main()
+{
+    current = tr24_shared_ptr(config_t, { 0, 10 }, cleanup);
+
+    pthread_t threads[4];
+    for(int i = 0; i < 4; ++i)
+        pthread_create(&threads[i], NULL, reader, NULL);
+
+    /* the old config is released once no reader can still see it */
+    for(int i = 1; i <= 3; ++i)
+        tr24_epoch_publish(&current,
+                           tr24_shared_ptr(config_t, { i, 10 * i }, cleanup));
+
+    for(int i = 0; i < 4; ++i)
+        pthread_join(threads[i], NULL);
+    tr24_epoch_synchronize();
+    tr24_epoch_publish(&current, NULL);
+    tr24_epoch_synchronize();
+    return 0;
+}
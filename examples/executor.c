@@ -0,0 +1,47 @@
+#define TR24_IMPL
+#include "../tr24_async.h"
+
+// the async function
+// (the async macro does nothing, it is only for decoration)
+async void *square(void *arg)
+{
+    long n = (long)arg;
+    return (void *)(n * n);
+}
+
+async void *hello(void *arg)
+{
+    tr24_promise_t *p = (tr24_promise_t *)arg;
+    printf("hello from a pool thread\n");
+    tr24_promise_set(p, (void *)"done");
+    return NULL;
+}
+
+int main()
+{
+    // four threads, started once
+    tr24_executor_t *ex = tr24_executor_create(4);
+
+    // submitting is a queue push, the result comes back in a promise that
+    // goes back to the executor for the next submits
+    tr24_promise_t *p[100];
+    for(long i = 0; i < 100; ++i)
+        p[i] = tr24_executor_submit(ex, square, (void *)i);
+    long sum = 0;
+    for(long i = 0; i < 100; ++i) {
+        sum += (long)tr24_promise_get(p[i]);
+        tr24_executor_release(ex, p[i]);
+    }
+    printf("sum of squares: %ld\n", sum);
+
+    // plain futures can run on the pool too
+    tr24_future_t *f = tr24_future_create(hello);
+    tr24_future_set_executor(f, ex);
+    tr24_promise_t *promise = tr24_promise_create();
+    f->await(f, promise);
+    printf("future says: %s\n", (char *)tr24_promise_get(promise));
+    tr24_promise_destroy(promise);
+    tr24_future_destroy(f);
+
+    tr24_executor_destroy(ex);
+}
@@ -0,0 +1,30 @@
+#define TR24_IMPL
+#include "../tr24_mutex.h"
+#include <pthread.h>
+#include <stdio.h>
+
+long counter = 0;
+tr24_mutex_t lock = TR24_MUTEX_INIT(&counter);
+
+void *count(void *arg)
+{
+    (void)arg;
+    for(int i = 0; i < 100000; i++) {
+        tr24_mutex_lock(&lock);
+        long *c = (long *)tr24_mutex_get(&lock);
+        (*c)++;
+        tr24_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+int main()
+{
+    pthread_t threads[4];
+    for(int i = 0; i < 4; i++)
+        pthread_create(&threads[i], NULL, count, NULL);
+    for(int i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+    // always 400000
+    printf("counter: %ld\n", counter);
+}
@@ -0,0 +1,36 @@
+#define TR24_SMARTPTR_IMPL
+#include "../tr24_smartptr.h"
+#include <cstdio>
+#include <string>
+#include <utility>
+#include <vector>
+
+// a unique pointer handed to a shared one is promoted in place, the object
+// is never memcpy'd, even when it did not get a compact header
+
+template <int N> void dummy_dtor(void *, void *) {}
+
+template <int... N> void fill_dtor_table(std::integer_sequence<int, N...>)
+{
+    (tr24sp__register_dtor(dummy_dtor<N>), ...);
+}
+
+int main()
+{
+    // inside a region every pointer gets a full header
+    tr24_region_t *region = tr24_region_begin(0);
+    {
+        auto u = tr24::make_unique<std::string>("short");
+        tr24::shared<std::string> s(std::move(u));
+        printf("from a region: %s\n", s->c_str());
+        s.reset();
+    }
+    tr24_region_end(region);
+
+    // so does everything once all compact destructor slots are taken
+    fill_dtor_table(std::make_integer_sequence<int, 256>());
+    auto u = tr24::make_unique<std::vector<std::string>>(2, "sso");
+    tr24::shared<std::vector<std::string>> s(std::move(u));
+    tr24::shared<std::vector<std::string>> t = s;
+    printf("with a full table: %s %s\n", (*t)[0].c_str(), (*t)[1].c_str());
+}
@@ -0,0 +1,15 @@
+#include <stdio.h>
+#define TR24_SMARTPTR_IMPL
+#include "../tr24_smartptr.h"
+
+int main()
+{
+    tr24_smart int *squares = tr24_vec(int, 4);
+    for(int i = 0; i < 100; ++i)
+        tr24_vec_push(squares, i * i);
+    /* The vector moved (or grew in place) a few times on the way. */
+    printf("length %zu, capacity %zu\n", array_length(squares),
+           array_capacity(squares));
+    printf("last one: %d\n", tr24_vec_pop(squares));
+    return 0;
+}
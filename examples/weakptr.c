@@ -0,0 +1,24 @@
+#include <stdio.h>
+#define TR24_SMARTPTR_IMPL
+#include "../tr24_smartptr.h"
+
+void cleanup(void *ptr, void *meta)
+{
+    (void)meta;
+    printf("destroying %d\n", *(int *)ptr);
+}
+
+int main()
+{
+    tr24_weak tr24_weak_ptr weak;
+    {
+        tr24_smart int *some_int = tr24_weak_shared_ptr(int, 42, cleanup);
+        weak = tr24_weak_ref(some_int);
+        /* Locking gives back a new strong reference while it's alive. */
+        tr24_smart int *other_int = tr24_weak_lock(weak);
+        printf("still alive: %d\n", *other_int);
+    }
+    /* The int is gone, only the weak reference's control block is left. */
+    printf("expired: %d\n", tr24_weak_expired(weak));
+    return 0;
+}
@@ -1,4 +1,4 @@
-/* tr24_async.h - v0.01 - public domain therealblue24 2023
+/* tr24_async.h - v0.03 - public domain therealblue24 2023
  * Simple async operations for C
  * 
  * This file provides both the interface and the implementation.
@@ -7,9 +7,28 @@
  *      #define TR24_IMPL
  * in *one* source file, before #including to generate the implementation.
  *
+ * Every future gets its own thread by default. A tr24_executor_t keeps a
+ * fixed number of threads around instead and runs submitted functions on
+ * them, so a task costs a queue push rather than a thread:
+ *
+ * tr24_executor_t *ex = tr24_executor_create(4);
+ * tr24_promise_t *p = tr24_executor_submit(ex, func, arg);
+ * void *res = tr24_promise_get(p);
+ * tr24_executor_release(ex, p);
+ * tr24_executor_destroy(ex);
+ *
+ * Released promises are kept by the executor for later submits, so a
+ * steady stream of tasks allocates nothing. tr24_promise_destroy works on
+ * them as well, they just aren't reused then.
+ *
+ * Futures move onto a pool with tr24_future_set_executor and are then
+ * awaited and destroyed like before. A pooled future runs one start at a
+ * time and cannot be stopped.
+ *
  * Examples are in examples folder.
  *
  * History:
+ *      0.03 fixed size thread pools (tr24_executor_t)
  *      0.02 wrapped tr24_async_t that you can await with no worries
  *      0.01 first public release
  */
@@ -44,6 +63,8 @@ extern "C" {
 #define TR24_FREE free
 #endif /* TR24_FREE */
 
+struct tr24_executor;
+
 typedef struct tr24_future {
     int __start_canary;
     pthread_t thread;
@@ -52,6 +73,9 @@ typedef struct tr24_future {
     int id;
     void *internal_arg;
     void (*await)(struct tr24_future *future, void *val);
+    /* set when the future runs on a pool, with the run in flight */
+    struct tr24_executor *executor;
+    struct tr24_promise *pending;
     int __end_canary;
 } tr24_future_t;
 
@@ -69,9 +93,33 @@ typedef struct tr24_promise {
     pthread_cond_t cond;
     bool done;
     int id;
+    /* on the executor's spare list while released */
+    struct tr24_promise *next;
     int __end_canary;
 } tr24_promise_t;
 
+typedef struct tr24_executor_task {
+    struct tr24_executor_task *next;
+    void *(*func)(void *arg);
+    void *arg;
+    tr24_promise_t *promise;
+} tr24_executor_task_t;
+
+typedef struct tr24_executor {
+    int __start_canary;
+    pthread_t *workers;
+    size_t worker_count;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    tr24_executor_task_t *head;
+    tr24_executor_task_t *tail;
+    /* finished tasks and released promises, reused by the next submits */
+    tr24_executor_task_t *spare;
+    tr24_promise_t *spare_promises;
+    bool stopping;
+    int __end_canary;
+} tr24_executor_t;
+
 typedef struct tr24_async {
     int __start_canary;
     tr24_promise_t *promise;
@@ -85,6 +133,8 @@ void tr24_future_start(tr24_future_t *future, void *arg);
 void tr24_future_stop(tr24_future_t *future);
 void tr24_future_destroy(tr24_future_t *future);
 void tr24_future_set_arg(tr24_future_t *future, void *arg);
+/* later starts run on ex instead of a new thread each */
+void tr24_future_set_executor(tr24_future_t *future, tr24_executor_t *ex);
 
 tr24_promise_t *tr24_promise_create();
 void *tr24_promise_get(tr24_promise_t *p);
@@ -92,6 +142,19 @@ void tr24_promise_set(tr24_promise_t *p, void *res);
 bool tr24_promise_done(tr24_promise_t *p);
 void tr24_promise_destroy(tr24_promise_t *p);
 
+/* workers of 0 means one per online cpu, NULL when out of memory or no
+ * thread could be started */
+tr24_executor_t *tr24_executor_create(size_t workers);
+/* runs func(arg) on a worker, its return value goes into the promise,
+ * which the caller gives back with tr24_executor_release. NULL when out of
+ * memory. */
+tr24_promise_t *tr24_executor_submit(tr24_executor_t *ex,
+                                     void *(*func)(void *arg), void *arg);
+/* waits for p, then keeps it for the next submit */
+void tr24_executor_release(tr24_executor_t *ex, tr24_promise_t *p);
+/* runs what is still queued, then stops the workers */
+void tr24_executor_destroy(tr24_executor_t *ex);
+
 tr24_async_t *tr24_async_env(tr24_future_t *future, tr24_promise_t *promise);
 void tr24_async_destroy(tr24_async_t *async);
 
@@ -114,6 +177,7 @@ void tr24_await(void *f, void *v);
 extern "C" {
 #endif
 
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
@@ -172,6 +236,8 @@ tr24_future_t *tr24_future_create(void *(*start_routine)(void *arg))
     future->func = start_routine;
     future->id = __global_id_thingy;
     future->await = _tr24_await_impl_future;
+    future->executor = NULL;
+    future->pending = NULL;
     srand(time(NULL));
     __global_id_thingy += rand();
     future->__start_canary = 1;
@@ -197,8 +263,20 @@ static void *tr24_future_func_wrapper(void *arg)
     return res;
 }
 
+void tr24_future_set_executor(tr24_future_t *future, tr24_executor_t *ex)
+{
+    future->executor = ex;
+}
+
 void tr24_future_start(tr24_future_t *future, void *arg)
 {
+    if(future->executor) {
+        if(future->pending)
+            tr24_executor_release(future->executor, future->pending);
+        future->pending =
+            tr24_executor_submit(future->executor, future->func, arg);
+        return;
+    }
     tr24_future_arg_t *future_arg =
         (tr24_future_arg_t *)TR24_MALLOC(sizeof(tr24_future_arg_t));
     future_arg->func = future->func;
@@ -209,28 +287,50 @@ void tr24_future_start(tr24_future_t *future, void *arg)
 
 void tr24_future_stop(tr24_future_t *future)
 {
+    if(future->executor)
+        return;
     pthread_cancel(future->thread);
 }
 
 void tr24_future_destroy(tr24_future_t *future)
 {
-    void *status;
-    int rc = pthread_join(future->thread, &status);
+    if(future->executor) {
+        if(future->pending)
+            tr24_executor_release(future->executor, future->pending);
+    } else {
+        void *status;
+        pthread_join(future->thread, &status);
+    }
     pthread_attr_destroy(&future->attr);
     __global_id_thingy = future->id;
     TR24_FREE(future);
 }
 
-tr24_promise_t *tr24_promise_create()
+static tr24_promise_t *tr24_promise_alloc(void)
 {
-    tr24_promise_t *promise = (tr24_promise_t *)malloc(sizeof(tr24_promise_t));
+    tr24_promise_t *promise =
+        (tr24_promise_t *)TR24_MALLOC(sizeof(tr24_promise_t));
+    if(promise == NULL)
+        return NULL;
     pthread_mutex_init(&promise->mutex, NULL);
     pthread_cond_init(&promise->cond, NULL);
+    promise->result = NULL;
+    promise->done = false;
+    promise->id = 0;
+    promise->next = NULL;
+    promise->__start_canary = 3;
+    promise->__end_canary = 3;
+    return promise;
+}
+
+tr24_promise_t *tr24_promise_create()
+{
+    tr24_promise_t *promise = tr24_promise_alloc();
+    if(promise == NULL)
+        return NULL;
     promise->id = __global_id_thingy;
     srand(time(NULL));
     __global_id_thingy += rand();
-    promise->__start_canary = 3;
-    promise->__end_canary = 3;
     return promise;
 }
 
@@ -268,6 +368,142 @@ void tr24_promise_destroy(tr24_promise_t *p)
     TR24_FREE(p);
 }
 
+static void *tr24_executor_worker(void *arg)
+{
+    tr24_executor_t *ex = (tr24_executor_t *)arg;
+    pthread_mutex_lock(&ex->mutex);
+    for(;;) {
+        while(ex->head == NULL && !ex->stopping)
+            pthread_cond_wait(&ex->cond, &ex->mutex);
+        tr24_executor_task_t *task = ex->head;
+        if(task == NULL)
+            break;
+        ex->head = task->next;
+        if(ex->head == NULL)
+            ex->tail = NULL;
+        pthread_mutex_unlock(&ex->mutex);
+
+        tr24_promise_set(task->promise, task->func(task->arg));
+
+        pthread_mutex_lock(&ex->mutex);
+        task->next = ex->spare;
+        ex->spare = task;
+    }
+    pthread_mutex_unlock(&ex->mutex);
+    return NULL;
+}
+
+tr24_executor_t *tr24_executor_create(size_t workers)
+{
+    if(workers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus > 0 ? (size_t)cpus : 1;
+    }
+    tr24_executor_t *ex =
+        (tr24_executor_t *)TR24_MALLOC(sizeof(tr24_executor_t));
+    if(ex == NULL)
+        return NULL;
+    ex->workers = (pthread_t *)TR24_MALLOC(workers * sizeof(pthread_t));
+    if(ex->workers == NULL) {
+        TR24_FREE(ex);
+        return NULL;
+    }
+    pthread_mutex_init(&ex->mutex, NULL);
+    pthread_cond_init(&ex->cond, NULL);
+    ex->head = NULL;
+    ex->tail = NULL;
+    ex->spare = NULL;
+    ex->spare_promises = NULL;
+    ex->stopping = false;
+    ex->worker_count = 0;
+    ex->__start_canary = 7;
+    ex->__end_canary = 7;
+    for(size_t i = 0; i < workers; ++i)
+        if(pthread_create(&ex->workers[ex->worker_count], NULL,
+                          tr24_executor_worker, ex) == 0)
+            ex->worker_count++;
+    if(ex->worker_count == 0) {
+        tr24_executor_destroy(ex);
+        return NULL;
+    }
+    return ex;
+}
+
+tr24_promise_t *tr24_executor_submit(tr24_executor_t *ex,
+                                     void *(*func)(void *arg), void *arg)
+{
+    pthread_mutex_lock(&ex->mutex);
+    tr24_promise_t *promise = ex->spare_promises;
+    if(promise)
+        ex->spare_promises = promise->next;
+    tr24_executor_task_t *task = ex->spare;
+    if(task)
+        ex->spare = task->next;
+    pthread_mutex_unlock(&ex->mutex);
+
+    /* allocations stay out of the lock */
+    if(promise == NULL)
+        promise = tr24_promise_alloc();
+    if(task == NULL)
+        task = (tr24_executor_task_t *)TR24_MALLOC(sizeof(*task));
+    if(promise == NULL || task == NULL) {
+        if(promise)
+            tr24_promise_destroy(promise);
+        TR24_FREE(task);
+        return NULL;
+    }
+    promise->result = NULL;
+    promise->done = false;
+
+    pthread_mutex_lock(&ex->mutex);
+    task->next = NULL;
+    task->func = func;
+    task->arg = arg;
+    task->promise = promise;
+    if(ex->tail)
+        ex->tail->next = task;
+    else
+        ex->head = task;
+    ex->tail = task;
+    pthread_cond_signal(&ex->cond);
+    pthread_mutex_unlock(&ex->mutex);
+    return promise;
+}
+
+void tr24_executor_release(tr24_executor_t *ex, tr24_promise_t *p)
+{
+    tr24_promise_get(p);
+    pthread_mutex_lock(&ex->mutex);
+    p->next = ex->spare_promises;
+    ex->spare_promises = p;
+    pthread_mutex_unlock(&ex->mutex);
+}
+
+void tr24_executor_destroy(tr24_executor_t *ex)
+{
+    pthread_mutex_lock(&ex->mutex);
+    ex->stopping = true;
+    pthread_cond_broadcast(&ex->cond);
+    pthread_mutex_unlock(&ex->mutex);
+    for(size_t i = 0; i < ex->worker_count; ++i)
+        pthread_join(ex->workers[i], NULL);
+
+    while(ex->spare) {
+        tr24_executor_task_t *next = ex->spare->next;
+        TR24_FREE(ex->spare);
+        ex->spare = next;
+    }
+    while(ex->spare_promises) {
+        tr24_promise_t *next = ex->spare_promises->next;
+        tr24_promise_destroy(ex->spare_promises);
+        ex->spare_promises = next;
+    }
+    pthread_mutex_destroy(&ex->mutex);
+    pthread_cond_destroy(&ex->cond);
+    TR24_FREE(ex->workers);
+    TR24_FREE(ex);
+}
+
 #ifdef __cplusplus
 }
 #endif
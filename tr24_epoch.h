@@ -0,0 +1,349 @@
+/* tr24_epoch.h - v0.01 - public domain therealblue24 2023
+ * Epoch based reclamation for read-mostly shared data
+ *
+ * This file provides both the interface and the implementation.
+ * To init the implementation,
+ *      #define TR24_EPOCH_IMPL or
+ *      #define TR24_IMPL
+ * in *one* source file, before #including to generate the implementation.
+ *
+ * Readers wrap their accesses in tr24_epoch_enter / tr24_epoch_exit and
+ * never touch a reference count. Writers swap in a new pointer and retire
+ * the old one, which is only released once every thread that could still
+ * be looking at it has left its read section:
+ *
+ * static config_t *volatile current;
+ *
+ * // reader, any thread
+ * tr24_epoch_enter();
+ * config_t *cfg = tr24_epoch_load(&current);
+ * use(cfg);
+ * tr24_epoch_exit();
+ *
+ * // writer
+ * tr24_epoch_publish(&current, tr24_shared_ptr(config_t, { ... }));
+ *
+ * Retired pointers are smart pointers from tr24_smartptr.h by default, the
+ * reference the slot held is dropped with sfree later on. Anything else can
+ * be retired with tr24_epoch_retire_fn. Read sections nest, must be short
+ * and must not call tr24_epoch_synchronize.
+ *
+ * Examples are in examples folder.
+ *
+ * History:
+ *      0.01 first public release
+ */
+#ifndef TR24_EPOCH_H_
+#define TR24_EPOCH_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+#ifndef TR24_MALLOC
+#define TR24_MALLOC malloc
+#endif /* TR24_MALLOC */
+
+#ifndef TR24_FREE
+#define TR24_FREE free
+#endif /* TR24_FREE */
+
+#ifndef TR24_ASSERT
+#define TR24_ASSERT assert
+#endif /* TR24_ASSERT */
+
+/* how many pointers a thread retires before it tries to reclaim some */
+#ifndef TR24_EPOCH_BATCH
+#define TR24_EPOCH_BATCH 64
+#endif /* TR24_EPOCH_BATCH */
+
+void tr24_epoch_enter(void);
+void tr24_epoch_exit(void);
+
+void tr24_epoch_retire_fn(void *ptr, void (*release)(void *));
+void tr24_epoch_retire(void *ptr);
+/* tries to move the epoch forward and releases what has become safe */
+void tr24_epoch_collect(void);
+/* blocks until everything this thread retired so far has been released */
+void tr24_epoch_synchronize(void);
+
+#define tr24_epoch_load(slot) __atomic_load_n((slot), __ATOMIC_ACQUIRE)
+
+#define tr24_epoch_publish(slot, ptr)                                   \
+    tr24_epoch_retire((void *)__atomic_exchange_n((slot), (ptr),         \
+                                                  __ATOMIC_ACQ_REL))
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TR24_EPOCH_H_ */
+
+#ifdef TR24_IMPL
+#define TR24_EPOCH_IMPL
+#endif /* TR24_IMPL */
+
+#ifdef TR24_EPOCH_IMPL
+#undef TR24_EPOCH_IMPL
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+/* from tr24_smartptr.h */
+void tr24sp__sfree(void *ptr);
+
+typedef struct tr24ep__s_node {
+    struct tr24ep__s_node *next;
+    void *ptr;
+    void (*release)(void *);
+    size_t epoch;
+} tr24ep__s_node;
+
+/* records are never freed, a thread that exits leaves its record for the
+ * next new thread to pick up */
+typedef struct tr24ep__s_record {
+    struct tr24ep__s_record *next;
+    /* epoch the thread entered at, shifted left by one, low bit set while
+     * it is inside a read section */
+    volatile size_t state;
+    volatile int in_use;
+    unsigned nest;
+    size_t retired;
+    tr24ep__s_node *head;
+    tr24ep__s_node *tail;
+} tr24ep__s_record;
+
+#define TR24EP_ACTIVE ((size_t)1)
+
+static volatile size_t tr24ep__global_epoch;
+static tr24ep__s_record *volatile tr24ep__records;
+static __thread tr24ep__s_record *tr24ep__self;
+static pthread_key_t tr24ep__key;
+static pthread_once_t tr24ep__once = PTHREAD_ONCE_INIT;
+
+/* limbo lists of exited threads, released by whoever collects next */
+static tr24ep__s_node *tr24ep__orphans;
+static volatile int tr24ep__orphans_lock;
+
+static void tr24ep__thread_exit(void *arg);
+
+static void tr24ep__init(void)
+{
+    pthread_key_create(&tr24ep__key, tr24ep__thread_exit);
+}
+
+static tr24ep__s_record *tr24ep__record(void)
+{
+    if(tr24ep__self)
+        return tr24ep__self;
+    pthread_once(&tr24ep__once, tr24ep__init);
+
+    tr24ep__s_record *rec;
+    for(rec = tr24ep__records; rec; rec = rec->next)
+        if(!rec->in_use && __sync_bool_compare_and_swap(&rec->in_use, 0, 1))
+            break;
+
+    if(rec == NULL) {
+        rec = (tr24ep__s_record *)TR24_MALLOC(sizeof(*rec));
+        if(rec == NULL)
+            abort();
+        *rec = (tr24ep__s_record){ .in_use = 1 };
+        tr24ep__s_record *head;
+        do {
+            head = tr24ep__records;
+            rec->next = head;
+        } while(!__sync_bool_compare_and_swap(&tr24ep__records, head, rec));
+    }
+
+    pthread_setspecific(tr24ep__key, rec);
+    return tr24ep__self = rec;
+}
+
+void tr24_epoch_enter(void)
+{
+    tr24ep__s_record *rec = tr24ep__record();
+    if(rec->nest++)
+        return;
+    rec->state = tr24ep__global_epoch << 1 | TR24EP_ACTIVE;
+    /* the announcement has to be visible before any shared pointer is read */
+    __sync_synchronize();
+}
+
+void tr24_epoch_exit(void)
+{
+    tr24ep__s_record *rec = tr24ep__self;
+    TR24_ASSERT(rec && rec->nest > 0);
+    if(--rec->nest)
+        return;
+    __sync_synchronize();
+    rec->state = 0;
+}
+
+/* the epoch can only move on once every thread inside a read section has
+ * seen the current one */
+static size_t tr24ep__try_advance(void)
+{
+    const size_t epoch = tr24ep__global_epoch;
+    for(tr24ep__s_record *rec = tr24ep__records; rec; rec = rec->next) {
+        const size_t state = rec->state;
+        if(state & TR24EP_ACTIVE && state >> 1 != epoch)
+            return epoch;
+    }
+    __sync_bool_compare_and_swap(&tr24ep__global_epoch, epoch, epoch + 1);
+    return tr24ep__global_epoch;
+}
+
+/* a node retired in epoch e can no longer be seen by anyone once the
+ * global epoch has reached e + 2 */
+static tr24ep__s_node *tr24ep__release_list(tr24ep__s_node *node,
+                                            size_t epoch)
+{
+    while(node && node->epoch + 2 <= epoch) {
+        tr24ep__s_node *next = node->next;
+        node->release(node->ptr);
+        TR24_FREE(node);
+        node = next;
+    }
+    return node;
+}
+
+static void tr24ep__collect_orphans(size_t epoch)
+{
+    if(!tr24ep__orphans ||
+       __sync_lock_test_and_set(&tr24ep__orphans_lock, 1))
+        return;
+    tr24ep__orphans = tr24ep__release_list(tr24ep__orphans, epoch);
+    __sync_lock_release(&tr24ep__orphans_lock);
+}
+
+static void tr24ep__collect(tr24ep__s_record *rec)
+{
+    const size_t epoch = tr24ep__try_advance();
+    rec->head = tr24ep__release_list(rec->head, epoch);
+    if(rec->head == NULL)
+        rec->tail = NULL;
+    tr24ep__collect_orphans(epoch);
+}
+
+void tr24_epoch_collect(void)
+{
+    tr24ep__s_record *rec = tr24ep__record();
+    if(rec->nest == 0)
+        tr24ep__collect(rec);
+}
+
+void tr24_epoch_retire_fn(void *ptr, void (*release)(void *))
+{
+    if(ptr == NULL)
+        return;
+    tr24ep__s_record *rec = tr24ep__record();
+    tr24ep__s_node *node = (tr24ep__s_node *)TR24_MALLOC(sizeof(*node));
+    if(node == NULL)
+        abort();
+    /* the node is tagged after the pointer was unlinked, so any reader that
+     * could still see it entered at this epoch or before */
+    __sync_synchronize();
+    *node = (tr24ep__s_node){
+        .ptr = ptr,
+        .release = release,
+        .epoch = tr24ep__global_epoch,
+    };
+    if(rec->tail)
+        rec->tail->next = node;
+    else
+        rec->head = node;
+    rec->tail = node;
+
+    if(++rec->retired % TR24_EPOCH_BATCH == 0 && rec->nest == 0)
+        tr24ep__collect(rec);
+}
+
+void tr24_epoch_retire(void *ptr)
+{
+    tr24_epoch_retire_fn(ptr, tr24sp__sfree);
+}
+
+void tr24_epoch_synchronize(void)
+{
+    tr24ep__s_record *rec = tr24ep__record();
+    TR24_ASSERT(rec->nest == 0);
+    for(;;) {
+        tr24ep__collect(rec);
+        if(rec->head == NULL)
+            return;
+        sched_yield();
+    }
+}
+
+static void tr24ep__thread_exit(void *arg)
+{
+    tr24ep__s_record *rec = (tr24ep__s_record *)arg;
+    rec->nest = 0;
+    rec->state = 0;
+    tr24ep__collect(rec);
+
+    if(rec->head) {
+        while(__sync_lock_test_and_set(&tr24ep__orphans_lock, 1))
+            while(tr24ep__orphans_lock)
+                ;
+        /* orphans are kept in epoch order too */
+        tr24ep__s_node **link = &tr24ep__orphans;
+        tr24ep__s_node *node = rec->head;
+        while(node) {
+            while(*link && (*link)->epoch <= node->epoch)
+                link = &(*link)->next;
+            tr24ep__s_node *next = node->next;
+            node->next = *link;
+            *link = node;
+            link = &node->next;
+            node = next;
+        }
+        __sync_lock_release(&tr24ep__orphans_lock);
+    }
+
+    *rec = (tr24ep__s_record){ .next = rec->next, .in_use = 1 };
+    tr24ep__self = NULL;
+    __sync_synchronize();
+    rec->in_use = 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TR24_EPOCH_IMPL */
+
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+*/
@@ -1,4 +1,4 @@
-/* tr24_mutex.h - v0.01 - public domain therealblue24 2023
+/* tr24_mutex.h - v0.08 - public domain therealblue24 2023
  * Simple Mutex Implementation for C
  * 
  * This file provides both the interface and the implementation.
@@ -7,9 +7,54 @@
  *      #define TR24_IMPL
  * in *one* source file, before #including to generate the implementation.
  *
+ * Mutexes are a single atomic word. Locking spins for a little while and
+ * then sleeps on a futex (Linux), or in a parking table elsewhere. They
+ * are passed by pointer and need no cleanup:
+ *
+ * static tr24_mutex_t lock = TR24_MUTEX_INIT(&table);
+ *
+ * tr24_mutex_lock(&lock);
+ * table_t *t = tr24_mutex_get(&lock);
+ * ...
+ * tr24_mutex_unlock(&lock);
+ *
+ * Read-mostly data can use tr24_rwlock_t instead, which lets readers in
+ * side by side and the same get/set calls, or tr24_seqlock_t for small
+ * plain values readers copy out without writing to the lock at all:
+ *
+ * static tr24_seqlock_t now_lock = TR24_SEQLOCK_INIT(NULL);
+ * static struct { long sec, nsec; } now;
+ *
+ * tr24_seqlock_read(&now_lock, copy, now);  // readers
+ * tr24_seqlock_set(&now_lock, now, next);   // writers
+ *
+ * Under heavy contention tr24_mcs_t queues the waiters up and hands the
+ * lock over in order, each waiter spinning on its own cache line.
+ * tr24_ticket_t is just as fair and lighter for a few threads.
+ *
+ * tr24_mutex_striped_t spreads one table's locking over a fixed set of
+ * mutexes picked by key.
+ *
+ * Any 32 bit word can be waited on until it changes, which replaces flag
+ * polling loops and is enough to build events, latches and barriers:
+ *
+ * static volatile uint32_t ready;
+ *
+ * while(__atomic_load_n(&ready, __ATOMIC_ACQUIRE) == 0)    // waiter
+ *     tr24_wait_on_address(&ready, 0, TR24_WAIT_FOREVER);
+ *
+ * __atomic_store_n(&ready, 1, __ATOMIC_RELEASE);           // setter
+ * tr24_wake_all(&ready);
+ *
  * Examples are in examples folder.
  *
  * History:
+ *      0.08 wait/wake on any address, parking table without futexes
+ *      0.07 striped lock tables
+ *      0.06 opt-in contention profiling (TR24_MUTEX_PROFILE)
+ *      0.05 MCS queue locks and ticket locks
+ *      0.04 reader-writer locks and seqlocks
+ *      0.03 real mutual exclusion: futex based, passed by pointer
  *      0.02 extern "C" and more
  *      0.01 first public release
  */
@@ -21,23 +66,303 @@ extern "C" {
 #endif
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef TR24_MALLOC
+#define TR24_MALLOC malloc
+#endif /* TR24_MALLOC */
+
+#ifndef TR24_FREE
+#define TR24_FREE free
+#endif /* TR24_FREE */
+
+/* how many times lock polls a held mutex before going to sleep */
+#ifndef TR24_MUTEX_SPIN
+#define TR24_MUTEX_SPIN 100
+#endif /* TR24_MUTEX_SPIN */
 
 struct tr24_mutex_t {
     void *value;
-    bool locked;
-    bool in_session_locked;
+    /* 0 unlocked, 1 locked, 2 locked and somebody may be sleeping */
+    volatile int state;
 };
 typedef struct tr24_mutex_t tr24_mutex_t;
 
+#define TR24_MUTEX_INIT(val) { .value = (val), .state = 0 }
+
 tr24_mutex_t tr24_mutex_create(void *val);
-void tr24_mutex_lock(tr24_mutex_t mtx);
-void tr24_mutex_unlock(tr24_mutex_t mtx);
-void *tr24_mutex_get(tr24_mutex_t mtx);
+void tr24_mutex_lock(tr24_mutex_t *mtx);
+bool tr24_mutex_trylock(tr24_mutex_t *mtx);
+void tr24_mutex_unlock(tr24_mutex_t *mtx);
+void *tr24_mutex_get(tr24_mutex_t *mtx);
 
 #define tr24_mutex_set(mtx, var, val) \
-    tr24_mutex_lock(mtx);             \
-    var = val;                        \
-    tr24_mutex_unlock(mtx);
+    do {                              \
+        tr24_mutex_lock(mtx);         \
+        var = val;                    \
+        tr24_mutex_unlock(mtx);       \
+    } while(0)
+
+/* Reader-writer lock. Any number of readers or one writer; once a writer
+ * is waiting new readers queue up behind it, so writers do not starve. */
+struct tr24_rwlock_t {
+    void *value;
+    /* number of readers holding the lock, or TR24_RWLOCK_WRITER */
+    volatile int state;
+    volatile int writers_waiting;
+    volatile int readers_waiting;
+    /* futex words, bumped on every wakeup */
+    volatile int writer_seq;
+    volatile int reader_seq;
+};
+typedef struct tr24_rwlock_t tr24_rwlock_t;
+
+#define TR24_RWLOCK_WRITER (1 << 30)
+
+#define TR24_RWLOCK_INIT(val)                                     \
+    { .value = (val), .state = 0, .writers_waiting = 0,           \
+      .readers_waiting = 0, .writer_seq = 0, .reader_seq = 0 }
+
+tr24_rwlock_t tr24_rwlock_create(void *val);
+void tr24_rwlock_rdlock(tr24_rwlock_t *lk);
+bool tr24_rwlock_tryrdlock(tr24_rwlock_t *lk);
+void tr24_rwlock_wrlock(tr24_rwlock_t *lk);
+bool tr24_rwlock_trywrlock(tr24_rwlock_t *lk);
+/* releases either kind of hold */
+void tr24_rwlock_unlock(tr24_rwlock_t *lk);
+void *tr24_rwlock_get(tr24_rwlock_t *lk);
+
+#define tr24_rwlock_set(lk, var, val) \
+    do {                              \
+        tr24_rwlock_wrlock(lk);       \
+        var = val;                    \
+        tr24_rwlock_unlock(lk);       \
+    } while(0)
+
+/* Sequence lock for small plain values. Readers never write to shared
+ * memory: they copy the value and retry if a writer got in the way.
+ * Writers are serialized by a mutex and never wait for readers, so the
+ * guarded value must be safe to copy while torn (no pointers to follow). */
+struct tr24_seqlock_t {
+    void *value;
+    /* odd while a write is in progress */
+    volatile unsigned seq;
+    tr24_mutex_t writer;
+};
+typedef struct tr24_seqlock_t tr24_seqlock_t;
+
+#define TR24_SEQLOCK_INIT(val) \
+    { .value = (val), .seq = 0, .writer = TR24_MUTEX_INIT(NULL) }
+
+tr24_seqlock_t tr24_seqlock_create(void *val);
+unsigned tr24_seqlock_read_begin(tr24_seqlock_t *sl);
+bool tr24_seqlock_read_retry(tr24_seqlock_t *sl, unsigned seq);
+void tr24_seqlock_write_lock(tr24_seqlock_t *sl);
+void tr24_seqlock_write_unlock(tr24_seqlock_t *sl);
+void *tr24_seqlock_get(tr24_seqlock_t *sl);
+
+/* copies var into dst, retrying until the copy is consistent */
+#define tr24_seqlock_read(sl, dst, var)                        \
+    do {                                                       \
+        unsigned tr24mtx__seq;                                 \
+        do {                                                   \
+            tr24mtx__seq = tr24_seqlock_read_begin(sl);        \
+            dst = var;                                         \
+        } while(tr24_seqlock_read_retry(sl, tr24mtx__seq));    \
+    } while(0)
+
+#define tr24_seqlock_set(sl, var, val)  \
+    do {                                \
+        tr24_seqlock_write_lock(sl);    \
+        var = val;                      \
+        tr24_seqlock_write_unlock(sl);  \
+    } while(0)
+
+#ifndef TR24_MUTEX_CACHE_LINE
+#define TR24_MUTEX_CACHE_LINE 64
+#endif /* TR24_MUTEX_CACHE_LINE */
+
+/* MCS queue lock. Waiters line up in a queue and each one spins on its
+ * own node, so a release touches only the next waiter's cache line and
+ * the lock is handed out in arrival order. Every lock call brings a node,
+ * usually on the stack, that has to stay put until the matching unlock:
+ *
+ * tr24_mcs_node_t node;
+ * tr24_mcs_lock(&lock, &node);
+ * ...
+ * tr24_mcs_unlock(&lock, &node);
+ */
+struct tr24_mcs_node_t {
+    struct tr24_mcs_node_t *volatile next;
+    /* 1 waiting, 2 waiting asleep, 0 the lock has been handed over */
+    volatile int wait;
+} __attribute__((aligned(TR24_MUTEX_CACHE_LINE)));
+typedef struct tr24_mcs_node_t tr24_mcs_node_t;
+
+struct tr24_mcs_t {
+    void *value;
+    tr24_mcs_node_t *volatile tail;
+};
+typedef struct tr24_mcs_t tr24_mcs_t;
+
+#define TR24_MCS_INIT(val) { .value = (val), .tail = NULL }
+
+tr24_mcs_t tr24_mcs_create(void *val);
+void tr24_mcs_lock(tr24_mcs_t *lk, tr24_mcs_node_t *node);
+bool tr24_mcs_trylock(tr24_mcs_t *lk, tr24_mcs_node_t *node);
+void tr24_mcs_unlock(tr24_mcs_t *lk, tr24_mcs_node_t *node);
+void *tr24_mcs_get(tr24_mcs_t *lk);
+
+#define tr24_mcs_set(lk, var, val)               \
+    do {                                         \
+        tr24_mcs_node_t tr24mtx__node;           \
+        tr24_mcs_lock(lk, &tr24mtx__node);       \
+        var = val;                               \
+        tr24_mcs_unlock(lk, &tr24mtx__node);     \
+    } while(0)
+
+/* Ticket lock. First come first served like the MCS lock, without the
+ * nodes, but every waiter polls the same word. Best for a handful of
+ * threads. */
+struct tr24_ticket_t {
+    void *value;
+    volatile unsigned next;
+    volatile unsigned owner;
+    volatile int sleepers;
+};
+typedef struct tr24_ticket_t tr24_ticket_t;
+
+#define TR24_TICKET_INIT(val) \
+    { .value = (val), .next = 0, .owner = 0, .sleepers = 0 }
+
+tr24_ticket_t tr24_ticket_create(void *val);
+void tr24_ticket_lock(tr24_ticket_t *lk);
+bool tr24_ticket_trylock(tr24_ticket_t *lk);
+void tr24_ticket_unlock(tr24_ticket_t *lk);
+void *tr24_ticket_get(tr24_ticket_t *lk);
+
+#define tr24_ticket_set(lk, var, val) \
+    do {                              \
+        tr24_ticket_lock(lk);         \
+        var = val;                    \
+        tr24_ticket_unlock(lk);       \
+    } while(0)
+
+/* Striped locks. A power of two number of mutexes, each on its own cache
+ * line, with a key picking one, so a big table can be locked per entry
+ * for a fixed cost. Keys are pointers or hashes, keys that land on the
+ * same stripe just share a lock:
+ *
+ * tr24_mutex_striped_t locks = tr24_mutex_striped_create(&table, 64);
+ *
+ * tr24_mutex_striped_lock_ptr(&locks, entry);
+ * ...
+ * tr24_mutex_striped_unlock_ptr(&locks, entry);
+ *
+ * Holding more than one stripe at a time is only safe through
+ * tr24_mutex_striped_lock_many, which always locks in stripe order. */
+typedef struct {
+    tr24_mutex_t lock;
+    char pad[TR24_MUTEX_CACHE_LINE - sizeof(tr24_mutex_t)];
+} tr24_mutex_stripe_t;
+
+struct tr24_mutex_striped_t {
+    void *value;
+    size_t mask;
+    tr24_mutex_stripe_t *stripes;
+    void *stripes_base;
+};
+typedef struct tr24_mutex_striped_t tr24_mutex_striped_t;
+
+/* count is rounded up to a power of two, stripes is NULL if out of memory */
+tr24_mutex_striped_t tr24_mutex_striped_create(void *val, size_t count);
+void tr24_mutex_striped_destroy(tr24_mutex_striped_t *st);
+tr24_mutex_t *tr24_mutex_striped_for(tr24_mutex_striped_t *st, size_t hash);
+tr24_mutex_t *tr24_mutex_striped_for_ptr(tr24_mutex_striped_t *st,
+                                         const void *ptr);
+void tr24_mutex_striped_lock(tr24_mutex_striped_t *st, size_t hash);
+void tr24_mutex_striped_unlock(tr24_mutex_striped_t *st, size_t hash);
+void tr24_mutex_striped_lock_ptr(tr24_mutex_striped_t *st, const void *ptr);
+void tr24_mutex_striped_unlock_ptr(tr24_mutex_striped_t *st, const void *ptr);
+/* locks every stripe the n hashes select, each once */
+void tr24_mutex_striped_lock_many(tr24_mutex_striped_t *st,
+                                  const size_t *hashes, size_t n);
+void tr24_mutex_striped_unlock_many(tr24_mutex_striped_t *st,
+                                    const size_t *hashes, size_t n);
+void *tr24_mutex_striped_get(tr24_mutex_striped_t *st);
+
+/* Waiting on addresses. tr24_wait_on_address sleeps while *addr still holds
+ * expected, for at most timeout_ns unless that is TR24_WAIT_FOREVER. It
+ * returns false on timeout and true otherwise, which includes spurious
+ * wakeups, so the caller checks the word again either way. The word has to
+ * be changed before the wake call. Without futexes (or with
+ * TR24_MUTEX_NO_FUTEX) sleepers park in a table of TR24_MUTEX_PARKING
+ * buckets hashed by address, the locks in here sleep the same way. */
+#define TR24_WAIT_FOREVER ((int64_t)-1)
+
+#ifndef TR24_MUTEX_PARKING
+#define TR24_MUTEX_PARKING 256
+#endif /* TR24_MUTEX_PARKING */
+
+bool tr24_wait_on_address(volatile uint32_t *addr, uint32_t expected,
+                          int64_t timeout_ns);
+void tr24_wake_one(volatile uint32_t *addr);
+void tr24_wake_all(volatile uint32_t *addr);
+
+/* Contention profiling. Define TR24_MUTEX_PROFILE, in every file that
+ * includes this header, to count per lock how often it was taken, how often
+ * that meant waiting, how long the waits were and how long it was held.
+ * Locks are told apart by address, the lock calls remember the first place
+ * each lock was taken from and tr24_mutex_profile_name can give it a name.
+ * tr24_mutex_profile_dump lists the locks that were waited on the most:
+ *
+ * tr24_mutex_profile_name(&lock, "table");
+ * ...
+ * tr24_mutex_profile_dump(stderr, 10);
+ *
+ * Hold times are only kept for exclusive holds. Seqlocks show up as their
+ * writer mutex. A lock freed and another one allocated at the same address
+ * share their numbers, locks beyond TR24_MUTEX_PROFILE_LOCKS all count
+ * into one overflow entry. */
+
+/* how many locks can be told apart, a power of two */
+#ifndef TR24_MUTEX_PROFILE_LOCKS
+#define TR24_MUTEX_PROFILE_LOCKS 1024
+#endif /* TR24_MUTEX_PROFILE_LOCKS */
+
+#define TR24_MUTEX_PROFILE_BUCKETS 32
+
+typedef struct tr24mtx__s_profile {
+    const void *volatile lock;
+    const char *volatile name;
+    const char *volatile file;
+    int line;
+    volatile size_t acquisitions;
+    volatile size_t contended;
+    volatile uint64_t wait_ns;
+    volatile uint64_t max_wait_ns;
+    /* hold_hist[i] counts holds of at most 1 << i ns, the last bucket
+     * everything longer */
+    volatile size_t hold_hist[TR24_MUTEX_PROFILE_BUCKETS];
+    uint64_t held_since;
+} tr24_mutex_profile_t;
+
+/* without TR24_MUTEX_PROFILE these do nothing and nothing is recorded */
+#ifdef TR24_MUTEX_PROFILE
+#include <stdio.h>
+
+void tr24_mutex_profile_name(const void *lock, const char *name);
+/* copies out up to max locks, most total wait first */
+size_t tr24_mutex_profile_snapshot(tr24_mutex_profile_t *out, size_t max);
+void tr24_mutex_profile_dump(FILE *out, size_t max);
+void tr24mtx__here(const char *file, int line);
+#else
+#define tr24_mutex_profile_name(lock, name) ((void)(lock), (void)(name))
+#define tr24_mutex_profile_snapshot(out, max) \
+    ((void)(out), (void)(max), (size_t)0)
+#define tr24_mutex_profile_dump(out, max) ((void)(out), (void)(max))
+#endif /* TR24_MUTEX_PROFILE */
 
 #ifdef __cplusplus
 }
@@ -56,33 +381,850 @@ void *tr24_mutex_get(tr24_mutex_t mtx);
 extern "C" {
 #endif
 
+/* the call site macros from an earlier include would rename the
+ * definitions below, they come back at the end */
+#ifdef TR24_MUTEX_PROFILE_SITES_
+#undef TR24_MUTEX_PROFILE_SITES_
+#undef tr24_mutex_lock
+#undef tr24_mutex_trylock
+#undef tr24_rwlock_rdlock
+#undef tr24_rwlock_tryrdlock
+#undef tr24_rwlock_wrlock
+#undef tr24_rwlock_trywrlock
+#undef tr24_seqlock_write_lock
+#undef tr24_mcs_lock
+#undef tr24_mcs_trylock
+#undef tr24_ticket_lock
+#undef tr24_ticket_trylock
+#endif /* TR24_MUTEX_PROFILE_SITES_ */
+
+#if defined(__linux__) && !defined(TR24_MUTEX_NO_FUTEX)
+#define TR24MTX_FUTEX
+#endif
+
+#include <errno.h>
+#ifdef TR24MTX_FUTEX
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <pthread.h>
+#endif /* TR24MTX_FUTEX */
+#include <limits.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
+
+static inline void tr24mtx__pause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#else
+    __sync_synchronize();
+#endif
+}
+
+#ifdef TR24MTX_FUTEX
+/* sleeps as long as *addr holds val, false once timeout_ns ran out */
+static bool tr24mtx__park(volatile void *addr, uint32_t val,
+                          int64_t timeout_ns)
+{
+    struct timespec ts, *rel = NULL;
+    if(timeout_ns >= 0) {
+        ts.tv_sec = (time_t)(timeout_ns / 1000000000);
+        ts.tv_nsec = (long)(timeout_ns % 1000000000);
+        rel = &ts;
+    }
+    return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, rel, NULL, 0) ==
+               0 ||
+           errno != ETIMEDOUT;
+}
+
+static void tr24mtx__unpark(volatile void *addr, int count)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+#else
+/* Every sleeper queues up in the bucket its address hashes to and waits
+ * on its own condition variable, so a wake only reaches threads parked on
+ * that address, oldest first. The word is checked under the bucket lock,
+ * which the waker takes after changing it, so no wake is lost. */
+typedef struct tr24mtx__s_parked {
+    struct tr24mtx__s_parked *next;
+    volatile void *addr;
+    pthread_cond_t cond;
+    bool woken;
+} tr24mtx__s_parked;
+
+typedef struct {
+    pthread_mutex_t lock;
+    tr24mtx__s_parked *head;
+} tr24mtx__s_bucket;
+
+static tr24mtx__s_bucket tr24mtx__parking[TR24_MUTEX_PARKING];
+static pthread_once_t tr24mtx__parking_once = PTHREAD_ONCE_INIT;
+
+static void tr24mtx__parking_init(void)
+{
+    for(int i = 0; i < TR24_MUTEX_PARKING; ++i)
+        pthread_mutex_init(&tr24mtx__parking[i].lock, NULL);
+}
+
+static tr24mtx__s_bucket *tr24mtx__bucket(volatile void *addr)
+{
+    pthread_once(&tr24mtx__parking_once, tr24mtx__parking_init);
+    const uint64_t hash =
+        ((uint64_t)(uintptr_t)addr >> 2) * 0x9e3779b97f4a7c15ull;
+    return &tr24mtx__parking[(hash >> 32) % TR24_MUTEX_PARKING];
+}
+
+static bool tr24mtx__park(volatile void *addr, uint32_t val,
+                          int64_t timeout_ns)
+{
+    struct timespec deadline;
+    if(timeout_ns >= 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += (time_t)(timeout_ns / 1000000000);
+        deadline.tv_nsec += (long)(timeout_ns % 1000000000);
+        if(deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    tr24mtx__s_bucket *bucket = tr24mtx__bucket(addr);
+    pthread_mutex_lock(&bucket->lock);
+    if(__atomic_load_n((volatile uint32_t *)addr, __ATOMIC_SEQ_CST) != val) {
+        pthread_mutex_unlock(&bucket->lock);
+        return true;
+    }
+
+    tr24mtx__s_parked self;
+    self.next = NULL;
+    self.addr = addr;
+    self.woken = false;
+    pthread_cond_init(&self.cond, NULL);
+    tr24mtx__s_parked **link = &bucket->head;
+    while(*link)
+        link = &(*link)->next;
+    *link = &self;
+
+    while(!self.woken) {
+        if(timeout_ns < 0)
+            pthread_cond_wait(&self.cond, &bucket->lock);
+        else if(pthread_cond_timedwait(&self.cond, &bucket->lock,
+                                       &deadline) == ETIMEDOUT)
+            break;
+    }
+    const bool woken = self.woken;
+    if(!woken) {
+        for(link = &bucket->head; *link != &self; link = &(*link)->next)
+            ;
+        *link = self.next;
+    }
+    pthread_mutex_unlock(&bucket->lock);
+    pthread_cond_destroy(&self.cond);
+    return woken;
+}
+
+static void tr24mtx__unpark(volatile void *addr, int count)
+{
+    tr24mtx__s_bucket *bucket = tr24mtx__bucket(addr);
+    pthread_mutex_lock(&bucket->lock);
+    for(tr24mtx__s_parked **link = &bucket->head; *link && count > 0;) {
+        tr24mtx__s_parked *parked = *link;
+        if(parked->addr != addr) {
+            link = &parked->next;
+            continue;
+        }
+        *link = parked->next;
+        parked->woken = true;
+        pthread_cond_signal(&parked->cond);
+        --count;
+    }
+    pthread_mutex_unlock(&bucket->lock);
+}
+#endif /* TR24MTX_FUTEX */
+
+/* sleeps as long as *addr holds val, or returns right away */
+static void tr24mtx__wait(volatile int *addr, int val)
+{
+    tr24mtx__park(addr, (uint32_t)val, TR24_WAIT_FOREVER);
+}
+
+static void tr24mtx__wake(volatile int *addr, int count)
+{
+    tr24mtx__unpark(addr, count);
+}
+
+bool tr24_wait_on_address(volatile uint32_t *addr, uint32_t expected,
+                          int64_t timeout_ns)
+{
+    return tr24mtx__park(addr, expected, timeout_ns);
+}
+
+void tr24_wake_one(volatile uint32_t *addr)
+{
+    tr24mtx__unpark(addr, 1);
+}
+
+void tr24_wake_all(volatile uint32_t *addr)
+{
+    tr24mtx__unpark(addr, INT_MAX);
+}
+
+#ifdef TR24_MUTEX_PROFILE
+static tr24_mutex_profile_t tr24mtx__prof_table[TR24_MUTEX_PROFILE_LOCKS];
+/* everything past a full table, the only entry without a lock address */
+static tr24_mutex_profile_t tr24mtx__prof_overflow;
+static __thread const char *tr24mtx__site_file;
+static __thread int tr24mtx__site_line;
+
+static uint64_t tr24mtx__now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void tr24mtx__here(const char *file, int line)
+{
+    tr24mtx__site_file = file;
+    tr24mtx__site_line = line;
+}
+
+static tr24_mutex_profile_t *tr24mtx__prof_of(const void *lock)
+{
+    const size_t hash =
+        (size_t)(((uint64_t)(uintptr_t)lock * 0x9e3779b97f4a7c15ull) >> 32);
+    for(size_t i = 0; i < TR24_MUTEX_PROFILE_LOCKS; ++i) {
+        tr24_mutex_profile_t *rec =
+            &tr24mtx__prof_table[(hash + i) & (TR24_MUTEX_PROFILE_LOCKS - 1)];
+        const void *key = __atomic_load_n(&rec->lock, __ATOMIC_ACQUIRE);
+        if(key == NULL &&
+           __sync_bool_compare_and_swap(&rec->lock, NULL, lock))
+            return rec;
+        if(__atomic_load_n(&rec->lock, __ATOMIC_ACQUIRE) == lock)
+            return rec;
+    }
+    return &tr24mtx__prof_overflow;
+}
+
+typedef struct {
+    uint64_t start;
+    const char *file;
+    int line;
+} tr24mtx__s_prof_call;
+
+/* the call site set by the lock macros is used up by the lock call right
+ * after it, whether that gets the lock or not */
+static tr24mtx__s_prof_call tr24mtx__prof_begin(void)
+{
+    tr24mtx__s_prof_call call = {
+        .start = tr24mtx__now(),
+        .file = tr24mtx__site_file,
+        .line = tr24mtx__site_line,
+    };
+    tr24mtx__site_file = NULL;
+    return call;
+}
+
+static void tr24mtx__prof_acquire(const void *lock,
+                                  const tr24mtx__s_prof_call *call,
+                                  bool contended, bool exclusive)
+{
+    const uint64_t now = tr24mtx__now();
+    tr24_mutex_profile_t *rec = tr24mtx__prof_of(lock);
+    if(call->file && rec->file == NULL &&
+       __sync_bool_compare_and_swap(&rec->file, NULL, call->file))
+        rec->line = call->line;
+
+    __sync_fetch_and_add(&rec->acquisitions, 1);
+    if(contended) {
+        const uint64_t wait = now - call->start;
+        __sync_fetch_and_add(&rec->contended, 1);
+        __sync_fetch_and_add(&rec->wait_ns, wait);
+        uint64_t max = rec->max_wait_ns;
+        while(wait > max &&
+              !__sync_bool_compare_and_swap(&rec->max_wait_ns, max, wait))
+            max = rec->max_wait_ns;
+    }
+    if(exclusive)
+        rec->held_since = now;
+}
+
+/* called by the holder, before it lets go */
+static void tr24mtx__prof_release(const void *lock)
+{
+    tr24_mutex_profile_t *rec = tr24mtx__prof_of(lock);
+    const uint64_t held = tr24mtx__now() - rec->held_since;
+    int bucket = held <= 1 ? 0 : 64 - __builtin_clzll(held - 1);
+    if(bucket >= TR24_MUTEX_PROFILE_BUCKETS)
+        bucket = TR24_MUTEX_PROFILE_BUCKETS - 1;
+    __sync_fetch_and_add(&rec->hold_hist[bucket], 1);
+}
+
+#define TR24MTX_PROF_START \
+    const tr24mtx__s_prof_call tr24mtx__call = tr24mtx__prof_begin();
+#define tr24mtx__prof_locked(lock, contended, exclusive) \
+    tr24mtx__prof_acquire((lock), &tr24mtx__call, (contended), (exclusive))
+#define tr24mtx__prof_unlocked(lock) tr24mtx__prof_release(lock)
+
+void tr24_mutex_profile_name(const void *lock, const char *name)
+{
+    tr24mtx__prof_of(lock)->name = name;
+}
+
+static int tr24mtx__prof_cmp(const void *a, const void *b)
+{
+    const uint64_t x = ((const tr24_mutex_profile_t *)a)->wait_ns,
+                   y = ((const tr24_mutex_profile_t *)b)->wait_ns;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+size_t tr24_mutex_profile_snapshot(tr24_mutex_profile_t *out, size_t max)
+{
+    tr24_mutex_profile_t *all = (tr24_mutex_profile_t *)TR24_MALLOC(
+        (TR24_MUTEX_PROFILE_LOCKS + 1) * sizeof(*all));
+    if(all == NULL)
+        return 0;
+
+    size_t n = 0;
+    for(size_t i = 0; i < TR24_MUTEX_PROFILE_LOCKS; ++i)
+        if(tr24mtx__prof_table[i].acquisitions)
+            all[n++] = tr24mtx__prof_table[i];
+    if(tr24mtx__prof_overflow.acquisitions)
+        all[n++] = tr24mtx__prof_overflow;
+    qsort(all, n, sizeof(*all), tr24mtx__prof_cmp);
+    if(n > max)
+        n = max;
+    for(size_t i = 0; i < n; ++i)
+        out[i] = all[i];
+    TR24_FREE(all);
+    return n;
+}
+
+void tr24_mutex_profile_dump(FILE *out, size_t max)
+{
+    if(max == 0)
+        return;
+    tr24_mutex_profile_t *locks =
+        (tr24_mutex_profile_t *)TR24_MALLOC(max * sizeof(*locks));
+    if(locks == NULL)
+        return;
+    const size_t n = tr24_mutex_profile_snapshot(locks, max);
+
+    fprintf(out, "%-24s %12s %12s %16s %14s\n", "lock", "acquired",
+            "contended", "wait ns", "max wait ns");
+    for(size_t i = 0; i < n; ++i) {
+        const tr24_mutex_profile_t *rec = &locks[i];
+        char label[32];
+        if(rec->name)
+            snprintf(label, sizeof(label), "%s", rec->name);
+        else if(rec->lock)
+            snprintf(label, sizeof(label), "%p", (void *)rec->lock);
+        else
+            snprintf(label, sizeof(label), "(overflow)");
+        fprintf(out, "%-24s %12zu %12zu %16llu %14llu", label,
+                rec->acquisitions, rec->contended,
+                (unsigned long long)rec->wait_ns,
+                (unsigned long long)rec->max_wait_ns);
+        if(rec->file)
+            fprintf(out, " %s:%d", rec->file, rec->line);
+        fprintf(out, "\n    held");
+        for(int b = 0; b < TR24_MUTEX_PROFILE_BUCKETS; ++b)
+            if(rec->hold_hist[b])
+                fprintf(out, " <=%lluns:%zu", 1ull << b, rec->hold_hist[b]);
+        fprintf(out, "\n");
+    }
+    TR24_FREE(locks);
+}
+#else
+#define TR24MTX_PROF_START
+#define tr24mtx__prof_locked(lock, contended, exclusive) ((void)0)
+#define tr24mtx__prof_unlocked(lock) ((void)0)
+#endif /* TR24_MUTEX_PROFILE */
+
 tr24_mutex_t tr24_mutex_create(void *val)
 {
-    tr24_mutex_t ret = { .value = val, false, false };
+    tr24_mutex_t ret = TR24_MUTEX_INIT(val);
     return ret;
 }
 
-void tr24_mutex_lock(tr24_mutex_t mtx)
+bool tr24_mutex_trylock(tr24_mutex_t *mtx)
 {
-    while(mtx.locked || mtx.in_session_locked)
-        ;
-    mtx.in_session_locked = true;
-    mtx.locked = true;
-    mtx.in_session_locked = false;
+    TR24MTX_PROF_START
+    if(__atomic_load_n(&mtx->state, __ATOMIC_RELAXED) != 0 ||
+       !__sync_bool_compare_and_swap(&mtx->state, 0, 1))
+        return false;
+    tr24mtx__prof_locked(mtx, false, true);
+    return true;
 }
 
-void tr24_mutex_unlock(tr24_mutex_t mtx)
+/* Drepper, "Futexes Are Tricky", mutex 3. Only a lock that has seen
+ * contention is marked 2, so uncontended unlocks never make a syscall. */
+static void tr24mtx__lock_slow(tr24_mutex_t *mtx, int state)
 {
-    while(mtx.locked == 0 || mtx.in_session_locked == 0)
-        ;
-    mtx.in_session_locked = true;
-    mtx.locked = false;
-    mtx.in_session_locked = false;
+    for(int i = 0; i < TR24_MUTEX_SPIN && state == 1; ++i) {
+        tr24mtx__pause();
+        state = __atomic_load_n(&mtx->state, __ATOMIC_RELAXED);
+        if(state == 0) {
+            state = __sync_val_compare_and_swap(&mtx->state, 0, 1);
+            if(state == 0)
+                return;
+        }
+    }
+
+    if(state != 2)
+        state = __atomic_exchange_n(&mtx->state, 2, __ATOMIC_ACQUIRE);
+    while(state != 0) {
+        tr24mtx__wait(&mtx->state, 2);
+        state = __atomic_exchange_n(&mtx->state, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+void tr24_mutex_lock(tr24_mutex_t *mtx)
+{
+    TR24MTX_PROF_START
+    const int state = __sync_val_compare_and_swap(&mtx->state, 0, 1);
+    if(state != 0)
+        tr24mtx__lock_slow(mtx, state);
+    tr24mtx__prof_locked(mtx, state != 0, true);
+}
+
+void tr24_mutex_unlock(tr24_mutex_t *mtx)
+{
+    tr24mtx__prof_unlocked(mtx);
+    if(__sync_fetch_and_sub(&mtx->state, 1) != 1) {
+        __atomic_store_n(&mtx->state, 0, __ATOMIC_RELEASE);
+        tr24mtx__wake(&mtx->state, 1);
+    }
+}
+
+void *tr24_mutex_get(tr24_mutex_t *mtx)
+{
+    return mtx->value;
+}
+
+tr24_rwlock_t tr24_rwlock_create(void *val)
+{
+    tr24_rwlock_t ret = TR24_RWLOCK_INIT(val);
+    return ret;
+}
+
+/* readers keep out while a writer holds the lock or waits for it */
+static bool tr24mtx__rd_blocked(tr24_rwlock_t *lk)
+{
+    return __atomic_load_n(&lk->state, __ATOMIC_SEQ_CST) &
+               TR24_RWLOCK_WRITER ||
+           __atomic_load_n(&lk->writers_waiting, __ATOMIC_SEQ_CST);
+}
+
+static bool tr24mtx__tryrd(tr24_rwlock_t *lk)
+{
+    for(;;) {
+        const int state = __atomic_load_n(&lk->state, __ATOMIC_RELAXED);
+        if(state & TR24_RWLOCK_WRITER ||
+           __atomic_load_n(&lk->writers_waiting, __ATOMIC_RELAXED))
+            return false;
+        if(__sync_bool_compare_and_swap(&lk->state, state, state + 1))
+            return true;
+    }
+}
+
+bool tr24_rwlock_tryrdlock(tr24_rwlock_t *lk)
+{
+    TR24MTX_PROF_START
+    if(!tr24mtx__tryrd(lk))
+        return false;
+    tr24mtx__prof_locked(lk, false, false);
+    return true;
+}
+
+static void tr24mtx__rdlock_slow(tr24_rwlock_t *lk)
+{
+    for(int i = 0; i < TR24_MUTEX_SPIN; ++i) {
+        if(tr24mtx__tryrd(lk))
+            return;
+        tr24mtx__pause();
+    }
+
+    while(!tr24mtx__tryrd(lk)) {
+        /* the count is raised before the last look at the lock, so whoever
+         * unblocks us afterwards sees it and bumps the futex word */
+        __sync_fetch_and_add(&lk->readers_waiting, 1);
+        const int seq = __atomic_load_n(&lk->reader_seq, __ATOMIC_SEQ_CST);
+        if(tr24mtx__rd_blocked(lk))
+            tr24mtx__wait(&lk->reader_seq, seq);
+        __sync_fetch_and_sub(&lk->readers_waiting, 1);
+    }
+}
+
+void tr24_rwlock_rdlock(tr24_rwlock_t *lk)
+{
+    TR24MTX_PROF_START
+    const bool contended = !tr24mtx__tryrd(lk);
+    if(contended)
+        tr24mtx__rdlock_slow(lk);
+    tr24mtx__prof_locked(lk, contended, false);
+}
+
+static bool tr24mtx__trywr(tr24_rwlock_t *lk)
+{
+    return __atomic_load_n(&lk->state, __ATOMIC_RELAXED) == 0 &&
+           __sync_bool_compare_and_swap(&lk->state, 0, TR24_RWLOCK_WRITER);
+}
+
+bool tr24_rwlock_trywrlock(tr24_rwlock_t *lk)
+{
+    TR24MTX_PROF_START
+    if(!tr24mtx__trywr(lk))
+        return false;
+    tr24mtx__prof_locked(lk, false, true);
+    return true;
+}
+
+static void tr24mtx__wrlock_slow(tr24_rwlock_t *lk)
+{
+    for(int i = 0; i < TR24_MUTEX_SPIN; ++i) {
+        if(tr24mtx__trywr(lk))
+            return;
+        tr24mtx__pause();
+    }
+
+    /* from here on new readers stay out */
+    __sync_fetch_and_add(&lk->writers_waiting, 1);
+    while(!tr24mtx__trywr(lk)) {
+        const int seq = __atomic_load_n(&lk->writer_seq, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&lk->state, __ATOMIC_SEQ_CST) != 0)
+            tr24mtx__wait(&lk->writer_seq, seq);
+    }
+    __sync_fetch_and_sub(&lk->writers_waiting, 1);
+}
+
+void tr24_rwlock_wrlock(tr24_rwlock_t *lk)
+{
+    TR24MTX_PROF_START
+    const bool contended = !tr24mtx__trywr(lk);
+    if(contended)
+        tr24mtx__wrlock_slow(lk);
+    tr24mtx__prof_locked(lk, contended, true);
+}
+
+void tr24_rwlock_unlock(tr24_rwlock_t *lk)
+{
+    int state = __atomic_load_n(&lk->state, __ATOMIC_RELAXED);
+    if(state == TR24_RWLOCK_WRITER) {
+        tr24mtx__prof_unlocked(lk);
+        __atomic_store_n(&lk->state, 0, __ATOMIC_SEQ_CST);
+    } else {
+        state = __sync_sub_and_fetch(&lk->state, 1);
+        if(state != 0)
+            return;
+    }
+
+    /* a waiting writer goes first, readers are woken all at once when
+     * none is left */
+    if(__atomic_load_n(&lk->writers_waiting, __ATOMIC_SEQ_CST)) {
+        __sync_fetch_and_add(&lk->writer_seq, 1);
+        tr24mtx__wake(&lk->writer_seq, 1);
+    } else if(__atomic_load_n(&lk->readers_waiting, __ATOMIC_SEQ_CST)) {
+        __sync_fetch_and_add(&lk->reader_seq, 1);
+        tr24mtx__wake(&lk->reader_seq, INT_MAX);
+    }
 }
 
-void *tr24_mutex_get(tr24_mutex_t mtx)
+void *tr24_rwlock_get(tr24_rwlock_t *lk)
 {
-    return mtx.value;
+    return lk->value;
+}
+
+tr24_seqlock_t tr24_seqlock_create(void *val)
+{
+    tr24_seqlock_t ret = TR24_SEQLOCK_INIT(val);
+    return ret;
+}
+
+unsigned tr24_seqlock_read_begin(tr24_seqlock_t *sl)
+{
+    unsigned seq;
+    while((seq = __atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE)) & 1)
+        tr24mtx__pause();
+    return seq;
+}
+
+bool tr24_seqlock_read_retry(tr24_seqlock_t *sl, unsigned seq)
+{
+    /* keeps the reads of the value from sinking below the check */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&sl->seq, __ATOMIC_RELAXED) != seq;
+}
+
+void tr24_seqlock_write_lock(tr24_seqlock_t *sl)
+{
+    tr24_mutex_lock(&sl->writer);
+    __atomic_store_n(&sl->seq, sl->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void tr24_seqlock_write_unlock(tr24_seqlock_t *sl)
+{
+    __atomic_store_n(&sl->seq, sl->seq + 1, __ATOMIC_RELEASE);
+    tr24_mutex_unlock(&sl->writer);
+}
+
+void *tr24_seqlock_get(tr24_seqlock_t *sl)
+{
+    return sl->value;
+}
+
+tr24_mcs_t tr24_mcs_create(void *val)
+{
+    tr24_mcs_t ret = TR24_MCS_INIT(val);
+    return ret;
+}
+
+bool tr24_mcs_trylock(tr24_mcs_t *lk, tr24_mcs_node_t *node)
+{
+    TR24MTX_PROF_START
+    node->next = NULL;
+    node->wait = 1;
+    if(__atomic_load_n(&lk->tail, __ATOMIC_RELAXED) != NULL ||
+       !__sync_bool_compare_and_swap(&lk->tail, NULL, node))
+        return false;
+    tr24mtx__prof_locked(lk, false, true);
+    return true;
+}
+
+static void tr24mtx__mcs_wait(tr24_mcs_node_t *node)
+{
+    for(int i = 0; i < TR24_MUTEX_SPIN; ++i) {
+        if(__atomic_load_n(&node->wait, __ATOMIC_ACQUIRE) == 0)
+            return;
+        tr24mtx__pause();
+    }
+    /* the predecessor may have been preempted, stop burning its cpu */
+    if(__sync_bool_compare_and_swap(&node->wait, 1, 2))
+        while(__atomic_load_n(&node->wait, __ATOMIC_ACQUIRE) != 0)
+            tr24mtx__wait(&node->wait, 2);
+}
+
+void tr24_mcs_lock(tr24_mcs_t *lk, tr24_mcs_node_t *node)
+{
+    TR24MTX_PROF_START
+    node->next = NULL;
+    node->wait = 1;
+    tr24_mcs_node_t *prev =
+        __atomic_exchange_n(&lk->tail, node, __ATOMIC_ACQ_REL);
+    if(prev != NULL) {
+        __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+        tr24mtx__mcs_wait(node);
+    }
+    tr24mtx__prof_locked(lk, prev != NULL, true);
+}
+
+void tr24_mcs_unlock(tr24_mcs_t *lk, tr24_mcs_node_t *node)
+{
+    tr24mtx__prof_unlocked(lk);
+    tr24_mcs_node_t *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+    if(next == NULL) {
+        if(__sync_bool_compare_and_swap(&lk->tail, node, NULL))
+            return;
+        /* somebody queued up but has not linked in yet */
+        for(int i = 0;
+            (next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL;
+            ++i) {
+            if(i < TR24_MUTEX_SPIN)
+                tr24mtx__pause();
+            else
+                sched_yield();
+        }
+    }
+    /* the successor may return and drop its node before the wake, waking
+     * a stale address is harmless */
+    if(__atomic_exchange_n(&next->wait, 0, __ATOMIC_RELEASE) == 2)
+        tr24mtx__wake(&next->wait, 1);
+}
+
+void *tr24_mcs_get(tr24_mcs_t *lk)
+{
+    return lk->value;
+}
+
+tr24_ticket_t tr24_ticket_create(void *val)
+{
+    tr24_ticket_t ret = TR24_TICKET_INIT(val);
+    return ret;
+}
+
+bool tr24_ticket_trylock(tr24_ticket_t *lk)
+{
+    TR24MTX_PROF_START
+    const unsigned owner = __atomic_load_n(&lk->owner, __ATOMIC_ACQUIRE);
+    if(!__sync_bool_compare_and_swap(&lk->next, owner, owner + 1))
+        return false;
+    tr24mtx__prof_locked(lk, false, true);
+    return true;
+}
+
+static void tr24mtx__ticket_wait(tr24_ticket_t *lk, unsigned ticket)
+{
+    for(int i = 0; i < TR24_MUTEX_SPIN; ++i) {
+        if(__atomic_load_n(&lk->owner, __ATOMIC_ACQUIRE) == ticket)
+            return;
+        tr24mtx__pause();
+    }
+
+    __sync_fetch_and_add(&lk->sleepers, 1);
+    for(;;) {
+        const unsigned owner = __atomic_load_n(&lk->owner, __ATOMIC_SEQ_CST);
+        if(owner == ticket)
+            break;
+        tr24mtx__wait((volatile int *)&lk->owner, (int)owner);
+    }
+    __sync_fetch_and_sub(&lk->sleepers, 1);
+}
+
+void tr24_ticket_lock(tr24_ticket_t *lk)
+{
+    TR24MTX_PROF_START
+    const unsigned ticket = __sync_fetch_and_add(&lk->next, 1);
+    const bool contended =
+        __atomic_load_n(&lk->owner, __ATOMIC_ACQUIRE) != ticket;
+    if(contended)
+        tr24mtx__ticket_wait(lk, ticket);
+    tr24mtx__prof_locked(lk, contended, true);
+}
+
+void tr24_ticket_unlock(tr24_ticket_t *lk)
+{
+    tr24mtx__prof_unlocked(lk);
+    const unsigned owner = __atomic_load_n(&lk->owner, __ATOMIC_RELAXED);
+    __atomic_store_n(&lk->owner, owner + 1, __ATOMIC_SEQ_CST);
+    /* only the next in line can go, but the futex cannot pick it out */
+    if(__atomic_load_n(&lk->sleepers, __ATOMIC_SEQ_CST))
+        tr24mtx__wake((volatile int *)&lk->owner, INT_MAX);
+}
+
+void *tr24_ticket_get(tr24_ticket_t *lk)
+{
+    return lk->value;
+}
+
+tr24_mutex_striped_t tr24_mutex_striped_create(void *val, size_t count)
+{
+    tr24_mutex_striped_t ret = {
+        .value = val, .mask = 0, .stripes = NULL, .stripes_base = NULL
+    };
+    size_t stripes = 1;
+    while(stripes < count)
+        stripes <<= 1;
+
+    ret.stripes_base = TR24_MALLOC(stripes * sizeof(tr24_mutex_stripe_t) +
+                                   TR24_MUTEX_CACHE_LINE);
+    if(ret.stripes_base == NULL)
+        return ret;
+    ret.stripes = (tr24_mutex_stripe_t *)(((uintptr_t)ret.stripes_base +
+                                           TR24_MUTEX_CACHE_LINE - 1) &
+                                          ~(uintptr_t)(TR24_MUTEX_CACHE_LINE -
+                                                       1));
+    for(size_t i = 0; i < stripes; ++i)
+        ret.stripes[i].lock = tr24_mutex_create(NULL);
+    ret.mask = stripes - 1;
+    return ret;
+}
+
+void tr24_mutex_striped_destroy(tr24_mutex_striped_t *st)
+{
+    TR24_FREE(st->stripes_base);
+    st->stripes_base = NULL;
+    st->stripes = NULL;
+    st->mask = 0;
+}
+
+/* keys are often aligned pointers or weak hashes, the low bits are mixed
+ * with the rest before picking a stripe */
+static size_t tr24mtx__stripe(tr24_mutex_striped_t *st, size_t hash)
+{
+    uint64_t x = (uint64_t)hash;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    return (size_t)x & st->mask;
+}
+
+tr24_mutex_t *tr24_mutex_striped_for(tr24_mutex_striped_t *st, size_t hash)
+{
+    return &st->stripes[tr24mtx__stripe(st, hash)].lock;
+}
+
+tr24_mutex_t *tr24_mutex_striped_for_ptr(tr24_mutex_striped_t *st,
+                                         const void *ptr)
+{
+    return tr24_mutex_striped_for(st, (size_t)(uintptr_t)ptr);
+}
+
+void tr24_mutex_striped_lock(tr24_mutex_striped_t *st, size_t hash)
+{
+    tr24_mutex_lock(tr24_mutex_striped_for(st, hash));
+}
+
+void tr24_mutex_striped_unlock(tr24_mutex_striped_t *st, size_t hash)
+{
+    tr24_mutex_unlock(tr24_mutex_striped_for(st, hash));
+}
+
+void tr24_mutex_striped_lock_ptr(tr24_mutex_striped_t *st, const void *ptr)
+{
+    tr24_mutex_lock(tr24_mutex_striped_for_ptr(st, ptr));
+}
+
+void tr24_mutex_striped_unlock_ptr(tr24_mutex_striped_t *st, const void *ptr)
+{
+    tr24_mutex_unlock(tr24_mutex_striped_for_ptr(st, ptr));
+}
+
+/* the lowest stripe from on that one of the n hashes selects, or SIZE_MAX.
+ * Quadratic, but n is a handful and nothing has to be allocated or
+ * sorted. */
+static size_t tr24mtx__next_stripe(tr24_mutex_striped_t *st,
+                                   const size_t *hashes, size_t n,
+                                   size_t from)
+{
+    size_t next = SIZE_MAX;
+    for(size_t i = 0; i < n; ++i) {
+        const size_t stripe = tr24mtx__stripe(st, hashes[i]);
+        if(stripe >= from && stripe < next)
+            next = stripe;
+    }
+    return next;
+}
+
+void tr24_mutex_striped_lock_many(tr24_mutex_striped_t *st,
+                                  const size_t *hashes, size_t n)
+{
+    /* everybody goes up through the stripes, nobody waits on a lower one
+     * while holding a higher one */
+    for(size_t stripe = tr24mtx__next_stripe(st, hashes, n, 0);
+        stripe != SIZE_MAX;
+        stripe = tr24mtx__next_stripe(st, hashes, n, stripe + 1))
+        tr24_mutex_lock(&st->stripes[stripe].lock);
+}
+
+void tr24_mutex_striped_unlock_many(tr24_mutex_striped_t *st,
+                                    const size_t *hashes, size_t n)
+{
+    for(size_t stripe = tr24mtx__next_stripe(st, hashes, n, 0);
+        stripe != SIZE_MAX;
+        stripe = tr24mtx__next_stripe(st, hashes, n, stripe + 1))
+        tr24_mutex_unlock(&st->stripes[stripe].lock);
+}
+
+void *tr24_mutex_striped_get(tr24_mutex_striped_t *st)
+{
+    return st->value;
 }
 
 #ifdef __cplusplus
@@ -91,6 +1233,24 @@ void *tr24_mutex_get(tr24_mutex_t mtx)
 
 #endif /* TR24_MUTEX_IMPL */
 
+/* the lock calls pass on where they were made from, this comes after the
+ * implementation so the definitions keep their names */
+#if defined(TR24_MUTEX_PROFILE) && !defined(TR24_MUTEX_PROFILE_SITES_)
+#define TR24_MUTEX_PROFILE_SITES_
+#define TR24MTX_HERE(call) (tr24mtx__here(__FILE__, __LINE__), call)
+#define tr24_mutex_lock(mtx) TR24MTX_HERE(tr24_mutex_lock(mtx))
+#define tr24_mutex_trylock(mtx) TR24MTX_HERE(tr24_mutex_trylock(mtx))
+#define tr24_rwlock_rdlock(lk) TR24MTX_HERE(tr24_rwlock_rdlock(lk))
+#define tr24_rwlock_tryrdlock(lk) TR24MTX_HERE(tr24_rwlock_tryrdlock(lk))
+#define tr24_rwlock_wrlock(lk) TR24MTX_HERE(tr24_rwlock_wrlock(lk))
+#define tr24_rwlock_trywrlock(lk) TR24MTX_HERE(tr24_rwlock_trywrlock(lk))
+#define tr24_seqlock_write_lock(sl) TR24MTX_HERE(tr24_seqlock_write_lock(sl))
+#define tr24_mcs_lock(lk, node) TR24MTX_HERE(tr24_mcs_lock(lk, node))
+#define tr24_mcs_trylock(lk, node) TR24MTX_HERE(tr24_mcs_trylock(lk, node))
+#define tr24_ticket_lock(lk) TR24MTX_HERE(tr24_ticket_lock(lk))
+#define tr24_ticket_trylock(lk) TR24MTX_HERE(tr24_ticket_trylock(lk))
+#endif /* TR24_MUTEX_PROFILE */
+
 /*
 This is free and unencumbered software released into the public domain.
 
@@ -1,4 +1,4 @@
-/* tr24_smartptr.h - v1.02 - public domain therealblue24 2023
+/* tr24_smartptr.h - v1.21 - public domain therealblue24 2023
  * A C smart pointer library using hacky GNU C extensions.
  *
  * This file provides both the interface and the implementation.
@@ -44,6 +44,23 @@
  * -therealblue24
  *
  * History:
+ *      1.21 sharded reference counts (TR24_SP_SHARDED) and tr24_sretire
+ *      1.20 C++ front-end (tr24::unique, tr24::shared), no more argument boxing
+ *      1.19 deferred destruction (TR24_SP_DEFER), tr24_sp_drain and a reclaimer
+ *      1.18 batch allocation (tr24_unique_batch etc.) and tr24sp__sfree_batch
+ *      1.17 bulk array destructors (.bulk_dtor) and tr24_array_dtor
+ *      1.16 tr24_mmap_arr, smart arrays backed by a file mapping
+ *      1.15 large and TR24_SP_HUGE entries get their own mappings
+ *      1.14 smove promotes promotable unique pointers in place
+ *      1.13 tr24_atomic_shared, an atomic slot for shared pointers
+ *      1.12 opt-in allocation statistics (TR24_SMARTPTR_STATS)
+ *      1.11 compact pointers with a single 8 byte header word
+ *      1.10 srealloc grows in place when it can, growable tr24_vec
+ *      1.09 over-aligned payloads through the align argument
+ *      1.08 local (non-atomic) and biased reference counting modes
+ *      1.07 weak references for shared pointers made with TR24_SP_WEAK
+ *      1.06 regions, bump allocated smart pointers released in bulk
+ *      1.05 optional size-class pool allocator (TR24_SMARTPTR_POOL)
  *      1.04 make so that tr24_*_arr has a non-constant length input
  *      1.03 continue on C <-> C++ compatibility
  *      1.02 option to use C++ (not offically supported)
@@ -53,13 +70,12 @@
  *      0.01 replace malloc, free, realloc and more calls with macros
  *      0.00 it works.
  */
-#if !defined(__cplusplus) || defined(TR24_CPP_USE_C_ABI)
 #ifndef TR24_SMARTPTR_H_
 #define TR24_SMARTPTR_H_
 
-#if defined(TR24_CPP_USE_C_ABI) && defined(__cplusplus)
+#ifdef __cplusplus
 extern "C" {
-#endif /* TR24_CPP_USE_C_ABI & __cplusplus */
+#endif /* __cplusplus */
 
 /* We want to use C23 attributes when we can */
 #if __STDC_VERSION__ >= 202311L
@@ -85,6 +101,7 @@ extern "C" {
 #endif /* __STDC_VERSION__ */
 
 #include <stdlib.h>
+#include <stdint.h>
 
 #define TR24SP_SENTINEL .sentinel_ = 0,
 #define TR24SP_SENTINEL_DEC int sentinel_;
@@ -93,18 +110,128 @@ enum tr24sp__pointer {
     TR24_SP_UNIQUE,
     TR24_SP_SHARED,
 
-    TR24_SP_ARRAY = 1 << 8
+    TR24_SP_ARRAY = 1 << 8,
+    TR24_SP_REGION = 1 << 9,
+    TR24_SP_WEAK = 1 << 10,
+    /* reference counting modes for shared pointers, the first set wins:
+     * TR24_SP_WEAK, TR24_SP_BIASED, TR24_SP_LOCAL, atomic. */
+    TR24_SP_LOCAL = 1 << 11,
+    TR24_SP_BIASED = 1 << 12,
+    TR24_SP_ALIGNED = 1 << 13,
+    TR24_SP_COMPACT = 1 << 14,
+    /* unique pointers with room for a reference count, tr24sp__smove turns
+     * them into shared pointers in place. Unique pointers of at least
+     * TR24SP_PROMOTE_THRESHOLD bytes get it without asking. */
+    TR24_SP_PROMOTABLE = 1 << 15,
+    TR24_SP_MAPPED = 1 << 16,
+    /* asks for huge page backed memory, see tr24__smalloc_mmap_threshold */
+    TR24_SP_HUGE = 1 << 17,
+    TR24_SP_FILE = 1 << 18,
+    /* the destructor is a tr24sp__f_bulk_destruct, set by bulk_dtor */
+    TR24_SP_BULK = 1 << 19,
+    /* carved out of a slab shared with others, see tr24sp__smalloc_batch */
+    TR24_SP_BATCH = 1 << 20,
+    /* the last sfree hands the object to tr24sp__drain, see below */
+    TR24_SP_DEFER = 1 << 21,
+    /* reference counts spread over per-thread shards, see tr24sp__sretire */
+    TR24_SP_SHARDED = 1 << 22
 };
 
+#ifndef TR24SP_PROMOTE_THRESHOLD
+#define TR24SP_PROMOTE_THRESHOLD 4096
+#endif /* TR24SP_PROMOTE_THRESHOLD */
+
 typedef void (*tr24sp__f_destruct)(void *, void *);
 
+/* Bulk destructors are called once for a whole array instead of once per
+ * element, with the elements, their count, the element size and the user
+ * meta. Plain pointers get a count of 1 and a size of 0. They are given with
+ * bulk_dtor:
+ *
+ * tr24_smart struct big *arr = tr24_unique_arr(struct big, n,
+ *                                              .bulk_dtor = free_bigs);
+ *
+ * tr24_array_dtor defines one that calls fn on a pointer to every element;
+ * the call can be inlined, and loops over empty destructors go away. */
+typedef void (*tr24sp__f_bulk_destruct)(void *, size_t, size_t, void *);
+
+#define tr24_array_dtor(name, t, fn)                                    \
+    static void name(void *base, size_t nmemb, size_t size, void *meta) \
+    {                                                                   \
+        (void)size;                                                     \
+        (void)meta;                                                     \
+        t *elements = (t *)base;                                        \
+        for(size_t i = 0; i < nmemb; ++i)                               \
+            fn(&elements[i]);                                           \
+    }
+
+/* Compact pointers (TR24_SP_COMPACT) carry a single 8 byte header word in
+ * front of the payload: kind bits, the index of their destructor in a small
+ * table and a 32 bit reference count. An offset word and the user meta only
+ * come along when there is user meta (arrays always have some). They can be
+ * unique or shared (atomic or TR24_SP_LOCAL), and fall back to the normal
+ * header when asked for anything else, inside a region, or once the
+ * destructor table is full. Destructors are added to the table on first use;
+ * tr24sp__register_dtor adds one ahead of time and returns its index. */
+int tr24sp__register_dtor(tr24sp__f_destruct dtor);
+
 typedef struct {
     void *(*alloc)(size_t);
     void (*dealloc)(void *);
+    /* optional, lets tr24sp__srealloc grow blocks without copying */
+    void *(*realloc)(void *, size_t);
 } tr24sp__s_allocator;
 
 extern tr24sp__s_allocator tr24__smalloc_allocator;
 
+/* Entries of at least this many payload bytes skip the allocator and get
+ * an anonymous mapping of their own, which goes straight back to the OS
+ * when they are freed. 0 turns that off. TR24_SP_HUGE entries are always
+ * mapped, with MAP_HUGETLB when the system has huge pages set aside and
+ * MADV_HUGEPAGE otherwise:
+ *
+ * tr24_smart double *samples = tr24_huge_unique_arr(double, 1 << 26);
+ */
+extern size_t tr24__smalloc_mmap_threshold;
+
+/* Arrays backed by a file mapping. The file's contents are the elements,
+ * so array_length is the file size over the element size; the mapping goes
+ * away with the last sfree. TR24_MMAP_COPY maps the file copy-on-write,
+ * writes then never reach the file, otherwise it is read-only. The other
+ * flags are madvise hints. NULL and errno are given back on failure, ENOSYS
+ * where the system or a strict -std= mode has no anonymous mappings.
+ *
+ * tr24_smart float *weights = tr24_mmap_arr(float, "weights.bin",
+ *                                           TR24_MMAP_SEQUENTIAL);
+ */
+enum tr24sp__mmap_flags {
+    TR24_MMAP_READONLY = 0,
+    TR24_MMAP_COPY = 1 << 0,
+    TR24_MMAP_SEQUENTIAL = 1 << 1,
+    TR24_MMAP_WILLNEED = 1 << 2,
+    TR24_MMAP_RANDOM = 1 << 3
+};
+
+void *tr24sp__mmap_arr(size_t type, const char *path, int flags,
+                       enum tr24sp__pointer kind);
+#define tr24_mmap_arr(t, path, flags) \
+    ((t *)tr24sp__mmap_arr(sizeof(t), (path), (flags), TR24_SP_UNIQUE))
+#define tr24_mmap_shared_arr(t, path, flags) \
+    ((t *)tr24sp__mmap_arr(sizeof(t), (path), (flags), TR24_SP_SHARED))
+
+#ifdef TR24_SMARTPTR_POOL
+/* Size-class pool allocator. Small blocks come from per-thread freelists
+ * that are refilled in batches from 64KiB slabs; blocks freed on another
+ * thread spill back to a shared central list once that thread's cache fills
+ * up. Defining TR24_SMARTPTR_POOL makes it the default smart allocator. */
+void *tr24sp__pool_alloc(size_t size);
+void tr24sp__pool_dealloc(void *ptr);
+void *tr24sp__pool_realloc(void *ptr, size_t size);
+void tr24sp__pool_flush(void);
+
+extern tr24sp__s_allocator tr24__smalloc_pool_allocator;
+#endif /* TR24_SMARTPTR_POOL */
+
 typedef struct {
     TR24SP_SENTINEL_DEC
     size_t size;
@@ -115,41 +242,34 @@ typedef struct {
         const void *data;
         size_t size;
     } meta;
+    /* power of two alignment of the returned pointer, 0 for the default */
+    size_t align;
+    tr24sp__f_bulk_destruct bulk_dtor;
 } tr24sp__s_smalloc_args;
 
 TR24_PURE void *tr24sp__get_smart_ptr_meta(void *ptr);
 void *tr24sp__sref(void *ptr);
 #define tr24_sref tr24sp__sref
 TR24_MALLOC_API void *tr24sp__smalloc(tr24sp__s_smalloc_args *args);
+/* NULL on failure, `ptr` is then left alone. A shared pointer with a dtor
+ * fails unless it's the last reference to its object. */
 void *tr24sp__srealloc(size_t type, void *ptr, size_t size);
 void tr24sp__sfree(void *ptr);
 void *tr24sp__smove_size(void *ptr, size_t size);
+/* frees a pointer nobody else holds without running its destructor, for
+ * objects that never got constructed */
+void tr24sp__sdiscard(void *ptr);
 
 #ifdef __cplusplus
-}
-#include <memory>
-
-template <typename T> static void *tr24sp__cppabi_ref_internal(T args)
-{
-    auto ptr = std::make_unique<T>(args);
-    return ptr.get();
-}
-
-static void *tr24sp__cppabi_ref_smargs_hidden(tr24sp__s_smalloc_args args)
-{
-    return tr24sp__cppabi_ref_internal<tr24sp__s_smalloc_args>(args);
-}
-
-extern "C" {
-
-TR24_INLINE static void *tr24sp__cppabi_ref(tr24sp__s_smalloc_args args)
+/* C++ has no addressable compound literals, the arguments are passed by
+ * value instead */
+TR24_INLINE static void *tr24sp__smalloc_v(tr24sp__s_smalloc_args args)
 {
-    return tr24sp__cppabi_ref_smargs_hidden(args);
+    return tr24sp__smalloc(&args);
 }
 
-#define tr24sp__smalloc_m(...)                                    \
-    tr24sp__smalloc((tr24sp__s_smalloc_args *)tr24sp__cppabi_ref( \
-        (tr24sp__s_smalloc_args){ TR24SP_SENTINEL __VA_ARGS__ }))
+#define tr24sp__smalloc_m(...) \
+    tr24sp__smalloc_v((tr24sp__s_smalloc_args){ TR24SP_SENTINEL __VA_ARGS__ })
 #else
 
 #define tr24sp__smalloc_m(...) \
@@ -158,8 +278,133 @@ TR24_INLINE static void *tr24sp__cppabi_ref(tr24sp__s_smalloc_args args)
 
 #define tr24_smalloc tr24sp__smalloc_m
 
+/* Makes a shared pointer out of a unique one. Compact and promotable unique
+ * pointers are promoted in place and come back with a count of two, one for
+ * the old pointer and one for the new. Others are copied into a new shared
+ * pointer, which takes over the destructor. Either way both get sfree'd:
+ *
+ * tr24_smart int *unique = tr24_unique_arr(int, 1 << 20);
+ * tr24_smart int *shared = tr24sp__smove(unique);
+ */
 #define tr24sp__smove(p) tr24sp__smove_size((p), sizeof(*(p)))
 
+/* Weak references. Only shared pointers made with TR24_SP_WEAK (see
+ * tr24_weak_shared_ptr) can hand them out. Those keep their reference counts
+ * in a separate control block: when the last strong reference is dropped the
+ * destructor runs and the object is freed, while the control block lives on
+ * until the last weak reference is released.
+ *
+ * tr24_weak tr24_weak_ptr weak = tr24_weak_ref(shared);
+ * tr24_smart int *strong = tr24_weak_lock(weak);
+ * if(strong) // still alive, and kept alive until strong leaves scope
+ */
+typedef struct tr24sp__s_ctrl *tr24_weak_ptr;
+
+tr24_weak_ptr tr24sp__weak_ref(void *ptr);
+tr24_weak_ptr tr24sp__weak_copy(tr24_weak_ptr weak);
+void *tr24sp__weak_lock(tr24_weak_ptr weak);
+int tr24sp__weak_expired(tr24_weak_ptr weak);
+void tr24sp__weak_release(tr24_weak_ptr weak);
+/* Biased shared pointers (TR24_SP_BIASED) are counted without atomics by
+ * the thread that made them and atomically by every other thread. When
+ * other threads release more references than they took, the object is
+ * queued back to its owner, which settles the counts the next time it
+ * touches a biased pointer or calls tr24sp__brc_drain. Threads that hand
+ * biased pointers out should call it now and then when otherwise idle.
+ * Local shared pointers (TR24_SP_LOCAL) never use atomics and must not be
+ * shared across threads at all; define TR24_SMARTPTR_SINGLE_THREADED to
+ * treat every shared pointer that way. */
+void tr24sp__brc_drain(void);
+#define tr24_brc_drain tr24sp__brc_drain
+
+/* Sharded shared pointers (TR24_SP_SHARDED) are for objects every thread
+ * refers to all the time. While their owner holds on to them, sref and sfree
+ * only touch one of TR24SP_SHARDS counters, each on a cache line of its own
+ * and picked per thread, and the count can't drop to zero. The owner's
+ * reference, the one smalloc handed out, is given back with tr24sp__sretire
+ * instead of sfree: that folds the shards into one exact count, which every
+ * sref and sfree after it uses, and the last of them destroys the object.
+ * srealloc retires the old object and makes the caller the new one's owner.
+ * The flag is ignored for weak, biased and local pointers and in regions.
+ *
+ * config_t *config = tr24_sharded_shared_ptr(config_t, { ... });
+ * // any thread, any number of times
+ * tr24_smart config_t *ref = tr24_sref(config);
+ * // once, by the owner
+ * tr24_sretire(config);
+ */
+void tr24sp__sretire(void *ptr);
+#define tr24_sretire tr24sp__sretire
+
+#ifndef TR24SP_SHARDS
+#define TR24SP_SHARDS 16
+#endif /* TR24SP_SHARDS */
+
+/* Deferred destruction. The last sfree of a TR24_SP_DEFER pointer doesn't
+ * run its destructor or give back its memory; the object is pushed on a
+ * lock-free queue instead, and tr24sp__drain finishes everything queued so
+ * far on the calling thread, returning how many objects it did. Or
+ * tr24sp__reclaimer_start starts a thread that drains the queue, polling
+ * every TR24SP_RECLAIM_INTERVAL microseconds when it finds nothing, and
+ * tr24sp__reclaimer_stop stops it after one last drain. Whatever is still
+ * queued at exit is leaked. Regions ignore the flag.
+ *
+ * tr24_sp_reclaimer_start();
+ * tr24_smart conn_t *conn = tr24__smart_ptr(TR24_SP_SHARED | TR24_SP_DEFER,
+ *                                           conn_t, .dtor = conn_close);
+ */
+size_t tr24sp__drain(void);
+int tr24sp__reclaimer_start(void);
+void tr24sp__reclaimer_stop(void);
+#define tr24_sp_drain tr24sp__drain
+#define tr24_sp_reclaimer_start tr24sp__reclaimer_start
+#define tr24_sp_reclaimer_stop tr24sp__reclaimer_stop
+
+#ifndef TR24SP_RECLAIM_INTERVAL
+#define TR24SP_RECLAIM_INTERVAL 1000
+#endif /* TR24SP_RECLAIM_INTERVAL */
+
+#define tr24_weak_ref tr24sp__weak_ref
+#define tr24_weak_copy tr24sp__weak_copy
+#define tr24_weak_lock tr24sp__weak_lock
+#define tr24_weak_expired tr24sp__weak_expired
+#define tr24_weak_release tr24sp__weak_release
+
+/* An atomic slot holding one reference to a shared pointer, for data that
+ * many threads read while another one replaces it now and then. Loads hand
+ * out a new reference, store, exchange and compare_exchange take their own
+ * reference to the new value. A load counts itself in the top bits of the
+ * slot before it touches the object, whoever swaps the object out passes
+ * those counts on to it, so it can't be freed between the two steps.
+ *
+ * static tr24_atomic_shared routes = TR24_ATOMIC_SHARED_INIT;
+ * tr24_smart route_t *r = tr24_atomic_shared_load(&routes);
+ * tr24_atomic_shared_store(&routes, new_routes);
+ *
+ * The pointers have to be shared and safe to count across threads, so not
+ * TR24_SP_LOCAL. */
+typedef struct {
+    volatile uint64_t word;
+} tr24_atomic_shared;
+
+#define TR24_ATOMIC_SHARED_INIT \
+    {                           \
+        0                       \
+    }
+
+void *tr24sp__atomic_shared_load(tr24_atomic_shared *slot);
+void tr24sp__atomic_shared_store(tr24_atomic_shared *slot, void *ptr);
+void *tr24sp__atomic_shared_exchange(tr24_atomic_shared *slot, void *ptr);
+/* on failure the reference in *expected is dropped and replaced with one to
+ * the current value */
+int tr24sp__atomic_shared_compare_exchange(tr24_atomic_shared *slot,
+                                           void **expected, void *desired);
+#define tr24_atomic_shared_load tr24sp__atomic_shared_load
+#define tr24_atomic_shared_store tr24sp__atomic_shared_store
+#define tr24_atomic_shared_exchange tr24sp__atomic_shared_exchange
+#define tr24_atomic_shared_compare_exchange \
+    tr24sp__atomic_shared_compare_exchange
+
 #include <string.h>
 
 TR24_INLINE void tr24sp__sfree_stack(void *ptr)
@@ -172,12 +417,21 @@ TR24_INLINE void tr24sp__sfree_stack(void *ptr)
     args.dtor,                        \
     {                                 \
         args.meta.ptr, args.meta.size \
-    }
+    },                                \
+    args.align, args.bulk_dtor
+
+TR24_INLINE void tr24sp__weak_release_stack(void *ptr)
+{
+    tr24sp__weak_release(*(tr24_weak_ptr *)ptr);
+    *(tr24_weak_ptr *)ptr = NULL;
+}
 
 #if __STDC_VERSION__ == 202311L
 #define tr24_smart [[gnu::cleanup(tr24sp__sfree_stack)]]
+#define tr24_weak [[gnu::cleanup(tr24sp__weak_release_stack)]]
 #else
 #define tr24_smart __attribute__((cleanup(tr24sp__sfree_stack)))
+#define tr24_weak __attribute__((cleanup(tr24sp__weak_release_stack)))
 #endif /* __STDC_VERSION__ */
 
 #ifndef TR24_MEMCPY
@@ -200,6 +454,10 @@ TR24_INLINE void tr24sp__sfree_stack(void *ptr)
 #define TR24_FREE free
 #endif /* TR24_FREE */
 
+#ifndef TR24_REALLOC
+#define TR24_REALLOC realloc
+#endif /* TR24_REALLOC */
+
 #define tr24__smart_ptr(k, t, ...)                                             \
     ({                                                                         \
         struct tr24sp__s_tmp {                                                 \
@@ -210,8 +468,11 @@ TR24_INLINE void tr24sp__sfree_stack(void *ptr)
                 const void *ptr;                                               \
                 size_t size;                                                   \
             } meta;                                                            \
+            size_t align;                                                      \
+            tr24sp__f_bulk_destruct bulk_dtor;                                 \
         } args = { TR24SP_SENTINEL __VA_ARGS__ };                              \
         const __typeof__(t[1]) dummy;                                          \
+        TR24SP_STATS_HERE();                                                   \
         void *var = sizeof(dummy[0]) == sizeof(dummy) ?                        \
                         tr24sp__smalloc_m(sizeof(t), 0, k, TR24SP__ARGS_) :    \
                         tr24sp__smalloc_m(sizeof(dummy[0]),                    \
@@ -232,7 +493,10 @@ TR24_INLINE void tr24sp__sfree_stack(void *ptr)
                 const void *ptr;                                       \
                 size_t size;                                           \
             } meta;                                                    \
+            size_t align;                                              \
+            tr24sp__f_bulk_destruct bulk_dtor;                         \
         } args = { TR24SP_SENTINEL __VA_ARGS__ };                      \
+        TR24SP_STATS_HERE();                                           \
         void *var = tr24sp__smalloc_m(sizeof(t), l, k, TR24SP__ARGS_); \
         if(var != NULL)                                                \
             if(args.value != NULL) {                                   \
@@ -243,17 +507,117 @@ TR24_INLINE void tr24sp__sfree_stack(void *ptr)
         var;                                                           \
     })
 
+/* Regions: while a region is open on a thread, every smart allocation made
+ * by that thread is bumped out of the region's chunks. sfree still runs the
+ * destructor when the last reference goes away, but the memory is only given
+ * back, all at once, by tr24_region_end. Destructors of objects still alive
+ * at that point run in reverse allocation order. Regions nest and must be
+ * ended in LIFO order on the thread that began them.
+ *
+ * {
+ *      tr24_region_scope tr24_region_t *region = tr24_region_begin(0);
+ *      tr24_smart int *ptr = tr24_unique_ptr(int, 42);
+ *      // ptr lives in region, which is released after ptr goes out of scope
+ * }
+ */
+typedef struct tr24sp__s_region tr24_region_t;
+
+tr24_region_t *tr24sp__region_begin(size_t chunk_size);
+void tr24sp__region_end(tr24_region_t *region);
+#define tr24_region_begin tr24sp__region_begin
+#define tr24_region_end tr24sp__region_end
+
+TR24_INLINE void tr24sp__region_end_stack(void *ptr)
+{
+    tr24sp__region_end(*(tr24_region_t **)ptr);
+    *(tr24_region_t **)ptr = NULL;
+}
+
+#if __STDC_VERSION__ == 202311L
+#define tr24_region_scope [[gnu::cleanup(tr24sp__region_end_stack)]]
+#else
+#define tr24_region_scope __attribute__((cleanup(tr24sp__region_end_stack)))
+#endif /* __STDC_VERSION__ */
+
+/* The payload can be over-aligned by naming the field, the header is then
+ * placed right in front of the aligned payload:
+ *
+ * tr24_smart float *vec = tr24_unique_arr(float, n, .align = 32);
+ */
 #define tr24_shared_ptr(t, ...) tr24__smart_ptr(TR24_SP_SHARED, t, __VA_ARGS__)
 #define tr24_unique_ptr(t, ...) tr24__smart_ptr(TR24_SP_UNIQUE, t, __VA_ARGS__)
+#define tr24_local_shared_ptr(t, ...) \
+    tr24__smart_ptr(TR24_SP_SHARED | TR24_SP_LOCAL, t, __VA_ARGS__)
+#define tr24_biased_shared_ptr(t, ...) \
+    tr24__smart_ptr(TR24_SP_SHARED | TR24_SP_BIASED, t, __VA_ARGS__)
+#define tr24_compact_unique_ptr(t, ...) \
+    tr24__smart_ptr(TR24_SP_UNIQUE | TR24_SP_COMPACT, t, __VA_ARGS__)
+#define tr24_compact_shared_ptr(t, ...) \
+    tr24__smart_ptr(TR24_SP_SHARED | TR24_SP_COMPACT, t, __VA_ARGS__)
+#define tr24_weak_shared_ptr(t, ...) \
+    tr24__smart_ptr(TR24_SP_SHARED | TR24_SP_WEAK, t, __VA_ARGS__)
+#define tr24_sharded_shared_ptr(t, ...) \
+    tr24__smart_ptr(TR24_SP_SHARED | TR24_SP_SHARDED, t, __VA_ARGS__)
 
 #define tr24_shared_arr(t, l, ...) \
     tr24__smart_arr(TR24_SP_SHARED, t, l, __VA_ARGS__)
 #define tr24_unique_arr(t, l, ...) \
     tr24__smart_arr(TR24_SP_UNIQUE, t, l, __VA_ARGS__)
+#define tr24_local_shared_arr(t, l, ...) \
+    tr24__smart_arr(TR24_SP_SHARED | TR24_SP_LOCAL, t, l, __VA_ARGS__)
+#define tr24_biased_shared_arr(t, l, ...) \
+    tr24__smart_arr(TR24_SP_SHARED | TR24_SP_BIASED, t, l, __VA_ARGS__)
+#define tr24_compact_unique_arr(t, l, ...) \
+    tr24__smart_arr(TR24_SP_UNIQUE | TR24_SP_COMPACT, t, l, __VA_ARGS__)
+#define tr24_compact_shared_arr(t, l, ...) \
+    tr24__smart_arr(TR24_SP_SHARED | TR24_SP_COMPACT, t, l, __VA_ARGS__)
+#define tr24_weak_shared_arr(t, l, ...) \
+    tr24__smart_arr(TR24_SP_SHARED | TR24_SP_WEAK, t, l, __VA_ARGS__)
+#define tr24_sharded_shared_arr(t, l, ...) \
+    tr24__smart_arr(TR24_SP_SHARED | TR24_SP_SHARDED, t, l, __VA_ARGS__)
+#define tr24_huge_unique_arr(t, l, ...) \
+    tr24__smart_arr(TR24_SP_UNIQUE | TR24_SP_HUGE, t, l, __VA_ARGS__)
+#define tr24_huge_shared_arr(t, l, ...) \
+    tr24__smart_arr(TR24_SP_SHARED | TR24_SP_HUGE, t, l, __VA_ARGS__)
+
+/* Batches: n zeroed smart pointers of one type, kind and destructor made
+ * with a single allocation. Every member keeps a full header of its own and
+ * is sfree'd on its own; the slab goes back once all of them are gone.
+ * tr24sp__sfree_batch drops a whole array of smart pointers at once (and
+ * NULLs it), settling the slab counts once per run of members. Batches
+ * return n, or 0 with nothing allocated. Weak, biased, aligned, array and
+ * region allocations are made one by one, compact ones get a full header.
+ *
+ * node_t *nodes[256];
+ * if(!tr24_shared_batch(node_t, 256, nodes, .dtor = node_dtor))
+ *      return -1;
+ * ...
+ * tr24sp__sfree_batch((void **)nodes, 256);
+ */
+size_t tr24sp__smalloc_batch(tr24sp__s_smalloc_args *args, size_t n,
+                             void **out);
+void tr24sp__sfree_batch(void **ptrs, size_t n);
+
+#define tr24__smart_batch(k, t, n, out, ...)                            \
+    ({                                                                  \
+        tr24sp__s_smalloc_args args = {                                 \
+            TR24SP_SENTINEL .size = sizeof(t), .kind = (k), __VA_ARGS__ \
+        };                                                              \
+        TR24SP_STATS_HERE();                                            \
+        tr24sp__smalloc_batch(&args, (n), (void **)(out));              \
+    })
+
+#define tr24_unique_batch(t, n, out, ...) \
+    tr24__smart_batch(TR24_SP_UNIQUE, t, n, out, __VA_ARGS__)
+#define tr24_shared_batch(t, n, out, ...) \
+    tr24__smart_batch(TR24_SP_SHARED, t, n, out, __VA_ARGS__)
+#define tr24_local_shared_batch(t, n, out, ...) \
+    tr24__smart_batch(TR24_SP_SHARED | TR24_SP_LOCAL, t, n, out, __VA_ARGS__)
 
 typedef struct {
     size_t nmemb;
     size_t size;
+    size_t capacity;
 } tr24sp__s_meta_array;
 
 TR24_PURE size_t tr24sp__array_length(void *ptr);
@@ -265,9 +629,311 @@ TR24_PURE size_t tr24sp__array_type_size(void *ptr);
 TR24_PURE void *tr24sp__array_user_meta(void *ptr);
 #define array_user_meta tr24sp__array_user_meta
 
-#if defined(TR24_CPP_USE_C_ABI) && defined(__cplusplus)
+TR24_PURE size_t tr24sp__array_capacity(void *ptr);
+#define array_capacity tr24sp__array_capacity
+
+/* Growable vectors: smart arrays whose capacity is tracked apart from their
+ * length, growing geometrically so pushes are amortized O(1). The vector
+ * variable is updated in place when it has to move. Like srealloc, a shared
+ * vector with a dtor only moves while the caller holds its last reference,
+ * otherwise the push fails.
+ *
+ * tr24_smart int *vec = tr24_vec(int, 16);
+ * for(int i = 0; i < 1000; ++i)
+ *      tr24_vec_push(vec, i);
+ * // array_length(vec) == 1000
+ */
+void *tr24sp__vec_create(size_t type, size_t capacity,
+                         enum tr24sp__pointer kind, tr24sp__f_destruct dtor);
+void *tr24sp__vec_reserve(void *ptr, size_t capacity);
+void *tr24sp__vec_push_slot(void **ptr);
+void *tr24sp__vec_pop_slot(void *ptr);
+
+#define tr24__vec(k, t, cap, ...)                                     \
+    ({                                                                \
+        struct tr24sp__s_tmp {                                        \
+            TR24SP_SENTINEL_DEC                                       \
+            tr24sp__f_destruct dtor;                                  \
+        } args = { TR24SP_SENTINEL __VA_ARGS__ };                     \
+        TR24SP_STATS_HERE();                                          \
+        (__typeof__(t) *)tr24sp__vec_create(sizeof(t), cap, k, args.dtor); \
+    })
+
+#define tr24_vec(t, cap, ...) tr24__vec(TR24_SP_UNIQUE, t, cap, __VA_ARGS__)
+#define tr24_shared_vec(t, cap, ...) \
+    tr24__vec(TR24_SP_SHARED, t, cap, __VA_ARGS__)
+
+#define tr24_vec_reserve(v, cap) \
+    ((v) = (__typeof__(v))tr24sp__vec_reserve((v), (cap)))
+
+#define tr24_vec_push(v, x)                                                   \
+    ({                                                                        \
+        __typeof__(v) tr24sp__slot =                                          \
+            (__typeof__(v))tr24sp__vec_push_slot((void **)&(v));              \
+        if(tr24sp__slot != NULL)                                              \
+            *tr24sp__slot = (x);                                              \
+        tr24sp__slot != NULL;                                                 \
+    })
+
+#define tr24_vec_pop(v) (*(__typeof__(v))tr24sp__vec_pop_slot((v)))
+
+/* Allocation statistics. Define TR24_SMARTPTR_STATS, in every file that
+ * includes this header, to count live objects and bytes per kind, sizes,
+ * reference traffic and time spent in destructors. Every thread counts into
+ * its own block, tr24_sp_stats_snapshot adds them up. Memory handed out by
+ * regions is not counted.
+ *
+ * TR24_SMARTPTR_STATS_SITES also makes the allocation macros remember where
+ * they were used, tr24_sp_stats_sites lists the busiest sites first:
+ *
+ * tr24_sp_stats_dump(stderr, 10);
+ */
+#if defined(TR24_SMARTPTR_STATS_SITES) && !defined(TR24_SMARTPTR_STATS)
+#define TR24_SMARTPTR_STATS
+#endif /* TR24_SMARTPTR_STATS_SITES */
+
+#ifdef TR24_SMARTPTR_STATS
+#include <stdio.h>
+
+#define TR24SP_STATS_BUCKETS 32
+
+enum {
+    TR24_SP_STATS_UNIQUE,
+    TR24_SP_STATS_SHARED,
+    TR24_SP_STATS_ARRAY,
+    TR24_SP_STATS_KINDS
+};
+
+typedef struct {
+    size_t allocs[TR24_SP_STATS_KINDS];
+    size_t frees[TR24_SP_STATS_KINDS];
+    size_t live_objects[TR24_SP_STATS_KINDS];
+    size_t live_bytes[TR24_SP_STATS_KINDS];
+    /* size_hist[i] counts allocations of at most 1 << i bytes */
+    size_t size_hist[TR24SP_STATS_BUCKETS];
+    size_t ref_inc;
+    size_t ref_dec;
+    size_t dtor_calls;
+    uint64_t dtor_ns;
+} tr24_sp_stats;
+
+typedef struct tr24sp__s_stats_site {
+    const char *file;
+    int line;
+    volatile int registered;
+    struct tr24sp__s_stats_site *next;
+    volatile size_t allocs;
+    volatile size_t frees;
+    volatile size_t bytes;
+    volatile size_t live_bytes;
+} tr24_sp_site_stats;
+
+void tr24sp__stats_snapshot(tr24_sp_stats *out);
+size_t tr24sp__stats_sites(tr24_sp_site_stats *out, size_t max);
+void tr24sp__stats_dump(FILE *out, size_t max_sites);
+void tr24sp__stats_here(struct tr24sp__s_stats_site *site);
+#define tr24_sp_stats_snapshot tr24sp__stats_snapshot
+#define tr24_sp_stats_sites tr24sp__stats_sites
+#define tr24_sp_stats_dump tr24sp__stats_dump
+#endif /* TR24_SMARTPTR_STATS */
+
+#ifdef TR24_SMARTPTR_STATS_SITES
+#define TR24SP_STATS_HERE()                                 \
+    do {                                                    \
+        static struct tr24sp__s_stats_site tr24sp__site = { \
+            .file = __FILE__,                               \
+            .line = __LINE__,                               \
+        };                                                  \
+        tr24sp__stats_here(&tr24sp__site);                  \
+    } while(0)
+#else
+#define TR24SP_STATS_HERE() ((void)0)
+#endif /* TR24_SMARTPTR_STATS_SITES */
+
+#ifdef __cplusplus
+}
+
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/* C++ front-end. tr24::unique<T> and tr24::shared<T> hold ordinary smart
+ * pointers, one pointer wide, so C and C++ can pass objects back and forth:
+ * release() hands the pointer over to code that sfree's it later, adopt()
+ * takes one over. Layouts are picked at compile time: compact headers when
+ * the type allows it, promotable ones otherwise so a unique always turns
+ * into a shared in place, and aligned entries for over-aligned types. The
+ * destructor is ~T, or none for trivially destructible types. Allocation
+ * failures throw std::bad_alloc, or give back an empty pointer when built
+ * without exceptions.
+ *
+ * auto conn = tr24::make_shared<conn_t>(fd, timeout);
+ * tr24::shared<conn_t> other = conn;
+ * c_api_keep(other.release());
+ */
+namespace tr24 {
+namespace detail {
+
+template <typename T> void destroy(void *ptr, void *)
+{
+    static_cast<T *>(ptr)->~T();
+}
+
+template <typename T> struct layout {
+    static constexpr size_t align =
+        alignof(T) > sizeof(void *) ? alignof(T) : 0;
+    /* compact headers are 64 bit only and keep the default alignment */
+    static constexpr int kind = sizeof(void *) == 8 && align == 0 ?
+                                    TR24_SP_COMPACT :
+                                    TR24_SP_PROMOTABLE;
+    static constexpr tr24sp__f_destruct dtor =
+        std::is_trivially_destructible<T>::value ? nullptr : destroy<T>;
+};
+
+template <typename T, typename... Args> T *make(int kind, Args &&...args)
+{
+    tr24sp__s_smalloc_args smargs = {};
+    smargs.size = sizeof(T);
+    smargs.kind = (enum tr24sp__pointer)(kind | layout<T>::kind);
+    smargs.dtor = layout<T>::dtor;
+    smargs.align = layout<T>::align;
+    void *ptr = tr24sp__smalloc(&smargs);
+#ifdef __cpp_exceptions
+    if(ptr == nullptr)
+        throw std::bad_alloc();
+    try {
+        return new(ptr) T(std::forward<Args>(args)...);
+    } catch(...) {
+        tr24sp__sdiscard(ptr);
+        throw;
+    }
+#else
+    return ptr ? new(ptr) T(std::forward<Args>(args)...) : nullptr;
+#endif /* __cpp_exceptions */
+}
+
+} // namespace detail
+
+template <typename T> class unique {
+public:
+    unique() noexcept : ptr_(nullptr) {}
+    unique(std::nullptr_t) noexcept : ptr_(nullptr) {}
+    unique(unique &&other) noexcept : ptr_(other.release()) {}
+    unique(const unique &) = delete;
+    ~unique() { tr24sp__sfree(ptr_); }
+
+    unique &operator=(unique &&other) noexcept
+    {
+        reset(other.release());
+        return *this;
+    }
+    unique &operator=(const unique &) = delete;
+
+    /* takes over a unique pointer made anywhere, C code included */
+    static unique adopt(T *ptr) noexcept
+    {
+        unique u;
+        u.ptr_ = ptr;
+        return u;
+    }
+
+    T *release() noexcept
+    {
+        T *ptr = ptr_;
+        ptr_ = nullptr;
+        return ptr;
+    }
+
+    void reset(T *ptr = nullptr) noexcept
+    {
+        T *old = ptr_;
+        ptr_ = ptr;
+        tr24sp__sfree(old);
+    }
+
+    T *get() const noexcept { return ptr_; }
+    T &operator*() const noexcept { return *ptr_; }
+    T *operator->() const noexcept { return ptr_; }
+    explicit operator bool() const noexcept { return ptr_ != nullptr; }
+
+private:
+    T *ptr_;
+};
+
+template <typename T> class shared {
+public:
+    shared() noexcept : ptr_(nullptr) {}
+    shared(std::nullptr_t) noexcept : ptr_(nullptr) {}
+    shared(const shared &other) noexcept
+        : ptr_((T *)tr24sp__sref(other.ptr_))
+    {
+    }
+    shared(shared &&other) noexcept : ptr_(other.release()) {}
+    /* smove, in place for everything tr24::make_unique makes */
+    shared(unique<T> &&other) noexcept : ptr_(nullptr)
+    {
+        if(other)
+            ptr_ = (T *)tr24sp__smove_size(other.get(), sizeof(T));
+        other.reset();
+    }
+    ~shared() { tr24sp__sfree(ptr_); }
+
+    shared &operator=(const shared &other) noexcept
+    {
+        reset((T *)tr24sp__sref(other.ptr_));
+        return *this;
+    }
+    shared &operator=(shared &&other) noexcept
+    {
+        reset(other.release());
+        return *this;
+    }
+
+    /* takes over one reference to a shared pointer */
+    static shared adopt(T *ptr) noexcept
+    {
+        shared s;
+        s.ptr_ = ptr;
+        return s;
+    }
+
+    T *release() noexcept
+    {
+        T *ptr = ptr_;
+        ptr_ = nullptr;
+        return ptr;
+    }
+
+    void reset(T *ptr = nullptr) noexcept
+    {
+        T *old = ptr_;
+        ptr_ = ptr;
+        tr24sp__sfree(old);
+    }
+
+    T *get() const noexcept { return ptr_; }
+    T &operator*() const noexcept { return *ptr_; }
+    T *operator->() const noexcept { return ptr_; }
+    explicit operator bool() const noexcept { return ptr_ != nullptr; }
+
+private:
+    T *ptr_;
+};
+
+template <typename T, typename... Args> unique<T> make_unique(Args &&...args)
+{
+    return unique<T>::adopt(
+        detail::make<T>(TR24_SP_UNIQUE, std::forward<Args>(args)...));
+}
+
+template <typename T, typename... Args> shared<T> make_shared(Args &&...args)
+{
+    return shared<T>::adopt(
+        detail::make<T>(TR24_SP_SHARED, std::forward<Args>(args)...));
 }
-#endif /* TR24_CPP_USE_C_ABI & __cplusplus */
+
+} // namespace tr24
+#endif /* __cplusplus */
 
 #endif /* TR24_SMARTPTR_H_ */
 
@@ -278,9 +944,9 @@ TR24_PURE void *tr24sp__array_user_meta(void *ptr);
 #ifdef TR24_SMARTPTR_IMPL
 #undef TR24_SMARTPTR_IMPL
 
-#if defined(TR24_CPP_USE_C_ABI) && defined(__cplusplus)
+#ifdef __cplusplus
 extern "C" {
-#endif /* TR24_CPP_USE_C_ABI & __cplusplus */
+#endif /* __cplusplus */
 
 TR24_PURE size_t tr24sp__array_length(void *ptr)
 {
@@ -296,6 +962,13 @@ TR24_PURE size_t tr24sp__array_type_size(void *ptr)
     return meta ? meta->size : 0;
 }
 
+TR24_PURE size_t tr24sp__array_capacity(void *ptr)
+{
+    tr24sp__s_meta_array *meta =
+        (tr24sp__s_meta_array *)tr24sp__get_smart_ptr_meta(ptr);
+    return meta ? meta->capacity : 0;
+}
+
 TR24_PURE TR24_INLINE void *tr24sp__array_user_meta(void *ptr)
 {
     tr24sp__s_meta_array *meta =
@@ -303,19 +976,108 @@ TR24_PURE TR24_INLINE void *tr24sp__array_user_meta(void *ptr)
     return meta ? meta + 1 : NULL;
 }
 
+#ifdef TR24_SMARTPTR_STATS
+typedef struct {
+    size_t bytes;
+    struct tr24sp__s_stats_site *site;
+} tr24sp__s_stats_tag;
+#define TR24SP_META_STATS tr24sp__s_stats_tag stats;
+#define TR24SP_META_STATS_INIT , .stats = { 0, NULL }
+#else
+#define TR24SP_META_STATS
+#define TR24SP_META_STATS_INIT
+#endif /* TR24_SMARTPTR_STATS */
+
 typedef struct {
     enum tr24sp__pointer kind;
     tr24sp__f_destruct dtor;
     void *ptr;
+    TR24SP_META_STATS
 } tr24sp__s_meta;
 
 typedef struct {
     enum tr24sp__pointer kind;
     tr24sp__f_destruct dtor;
     void *ptr;
+    TR24SP_META_STATS
     volatile size_t ref_count;
 } tr24sp__s_meta_shared;
 
+struct tr24sp__s_ctrl {
+    volatile size_t strong;
+    /* all strong references together hold one weak reference */
+    volatile size_t weak;
+    void *ptr;
+};
+
+typedef struct {
+    enum tr24sp__pointer kind;
+    tr24sp__f_destruct dtor;
+    void *ptr;
+    TR24SP_META_STATS
+    struct tr24sp__s_ctrl *ctrl;
+} tr24sp__s_meta_weak;
+
+typedef struct tr24sp__s_brc_queue {
+    void *volatile head;
+} tr24sp__s_brc_queue;
+
+typedef struct {
+    enum tr24sp__pointer kind;
+    tr24sp__f_destruct dtor;
+    void *ptr;
+    TR24SP_META_STATS
+    /* count of the other threads, shifted left by two to make room for
+     * the TR24SP_BRC_* flags. It goes negative when they release
+     * references that were counted by the owner. */
+    volatile intptr_t shared;
+    tr24sp__s_brc_queue *owner;
+    size_t biased;
+    void *next;
+} tr24sp__s_meta_biased;
+
+#define TR24SP_CACHE_LINE 64
+
+typedef struct {
+    volatile intptr_t count;
+    char pad[TR24SP_CACHE_LINE - sizeof(intptr_t)];
+} tr24sp__s_shard;
+
+typedef struct {
+    enum tr24sp__pointer kind;
+    tr24sp__f_destruct dtor;
+    void *ptr;
+    TR24SP_META_STATS
+    /* carries TR24SP_SHARD_BIAS until the owner retires the pointer, the
+     * shards can go negative meanwhile */
+    volatile size_t ref_count;
+    tr24sp__s_shard *shards;
+    void *shards_base;
+} tr24sp__s_meta_sharded;
+
+TR24_INLINE static size_t tr24sp__head_size(enum tr24sp__pointer kind)
+{
+    if(!(kind & TR24_SP_SHARED))
+        return kind & TR24_SP_PROMOTABLE ? sizeof(tr24sp__s_meta_shared) :
+                                           sizeof(tr24sp__s_meta);
+    if(kind & TR24_SP_WEAK)
+        return sizeof(tr24sp__s_meta_weak);
+    if(kind & TR24_SP_BIASED)
+        return sizeof(tr24sp__s_meta_biased);
+    if(kind & TR24_SP_SHARDED)
+        return sizeof(tr24sp__s_meta_sharded);
+    return sizeof(tr24sp__s_meta_shared);
+}
+
+/* sits right in front of the header of entries that don't start at the
+ * beginning of their allocation */
+typedef struct {
+    void *base;
+    size_t length;
+} tr24sp__s_prefix;
+
+#define TR24SP_MIN_ALIGN sizeof(char *)
+
 TR24_INLINE size_t tr24sp__align(size_t s)
 {
     return (s + (sizeof(char *) - 1)) & ~(sizeof(char *) - 1);
@@ -327,128 +1089,1288 @@ TR24_PURE TR24_INLINE tr24sp__s_meta *tr24sp__get_meta(void *ptr)
     return (tr24sp__s_meta *)((char *)size - *size);
 }
 
+/* The compact header word takes the place of the offset word, which is
+ * always a multiple of the pointer size, so its low bit tells them apart. */
+#define TR24SP_COMPACT_TAG ((uint64_t)1)
+#define TR24SP_COMPACT_SHARED ((uint64_t)1 << 1)
+#define TR24SP_COMPACT_ARRAY ((uint64_t)1 << 2)
+#define TR24SP_COMPACT_LOCAL ((uint64_t)1 << 3)
+#define TR24SP_COMPACT_META ((uint64_t)1 << 4)
+#define TR24SP_COMPACT_BULK ((uint64_t)1 << 5)
+#define TR24SP_COMPACT_DTOR_SHIFT 16
+#define TR24SP_COMPACT_DTOR_MASK ((uint64_t)0xffff << TR24SP_COMPACT_DTOR_SHIFT)
+#define TR24SP_COMPACT_REF_ONE ((uint64_t)1 << 32)
+
+#ifndef TR24SP_DTOR_TABLE
+#define TR24SP_DTOR_TABLE 256
+#endif /* TR24SP_DTOR_TABLE */
+
+/* index 0 stands for no destructor */
+static tr24sp__f_destruct tr24sp__dtor_table[TR24SP_DTOR_TABLE];
+static volatile int tr24sp__dtor_count = 1;
+static volatile int tr24sp__dtor_lock;
+
+TR24_PURE TR24_INLINE static volatile uint64_t *tr24sp__compact_word(void *ptr)
+{
+    return (volatile uint64_t *)ptr - 1;
+}
+
+TR24_PURE TR24_INLINE static int tr24sp__is_compact(void *ptr)
+{
+#if SIZE_MAX == UINT64_MAX
+    return (*tr24sp__compact_word(ptr) & TR24SP_COMPACT_TAG) != 0;
+#else
+    (void)ptr;
+    return 0;
+#endif /* SIZE_MAX == UINT64_MAX */
+}
+
+/* the offset word of compact pointers with user meta sits before the
+ * header word and only measures the user meta */
+TR24_PURE TR24_INLINE static void *tr24sp__compact_meta(void *ptr)
+{
+    if(!(*tr24sp__compact_word(ptr) & TR24SP_COMPACT_META))
+        return NULL;
+    size_t *metasize = (size_t *)ptr - 2;
+    return (char *)metasize - *metasize;
+}
+
+TR24_INLINE static int tr24sp__compact_kind(uint64_t word)
+{
+    return TR24_SP_COMPACT |
+           (word & TR24SP_COMPACT_SHARED ? TR24_SP_SHARED : 0) |
+           (word & TR24SP_COMPACT_LOCAL ? TR24_SP_LOCAL : 0) |
+           (word & TR24SP_COMPACT_ARRAY ? TR24_SP_ARRAY : 0) |
+           (word & TR24SP_COMPACT_BULK ? TR24_SP_BULK : 0);
+}
+
+TR24_INLINE static tr24sp__f_destruct tr24sp__compact_dtor(uint64_t word)
+{
+    return tr24sp__dtor_table[(word & TR24SP_COMPACT_DTOR_MASK) >>
+                              TR24SP_COMPACT_DTOR_SHIFT];
+}
+
+static void tr24sp__compact_sref(void *ptr);
+static void tr24sp__compact_sfree(void *ptr);
+
 #include <errno.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+/* strict ISO modes hide anonymous mappings, everything then goes through
+ * malloc like on other systems */
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif /* MAP_ANON */
+#ifdef MAP_ANONYMOUS
+#define TR24SP_HAVE_MMAP
+#endif /* MAP_ANONYMOUS */
+#endif /* __unix__ || __APPLE__ */
+
+#if defined(__linux__) && (!defined(_POSIX_C_SOURCE) || _POSIX_C_SOURCE < 199309L)
+/* hidden by -std=c99/c11, the reclaimer thread still needs it */
+int nanosleep(const struct timespec *req, struct timespec *rem);
+#endif /* _POSIX_C_SOURCE */
 
 #undef tr24sp__smalloc
 
-tr24sp__s_allocator tr24__smalloc_allocator = { TR24_MALLOC, TR24_FREE };
+#ifdef TR24_SMARTPTR_STATS
+#include <time.h>
+
+typedef struct tr24sp__s_stats_local {
+    struct tr24sp__s_stats_local *next;
+    size_t allocs[TR24_SP_STATS_KINDS];
+    size_t frees[TR24_SP_STATS_KINDS];
+    size_t alloc_bytes[TR24_SP_STATS_KINDS];
+    size_t free_bytes[TR24_SP_STATS_KINDS];
+    size_t size_hist[TR24SP_STATS_BUCKETS];
+    size_t ref_inc;
+    size_t ref_dec;
+    size_t dtor_calls;
+    uint64_t dtor_ns;
+} tr24sp__s_stats_local;
+
+/* blocks of running threads, and the sum of those that have exited */
+static tr24sp__s_stats_local *tr24sp__stats_threads;
+static tr24sp__s_stats_local tr24sp__stats_retired;
+static volatile int tr24sp__stats_lock;
+static struct tr24sp__s_stats_site *volatile tr24sp__stats_site_list;
+
+static __thread tr24sp__s_stats_local *tr24sp__stats_local;
+/* counted into when a thread can't get a block of its own */
+static __thread tr24sp__s_stats_local tr24sp__stats_spare;
+static __thread struct tr24sp__s_stats_site *tr24sp__stats_site;
+static pthread_key_t tr24sp__stats_key;
+static pthread_once_t tr24sp__stats_once = PTHREAD_ONCE_INIT;
+
+TR24_INLINE static void tr24sp__stats_acquire(void)
+{
+    while(__sync_lock_test_and_set(&tr24sp__stats_lock, 1))
+        while(tr24sp__stats_lock)
+            ;
+}
 
-TR24_INLINE static size_t atomic_add(volatile size_t *count, const size_t limit,
-                                     const size_t val)
+TR24_INLINE static void tr24sp__stats_release(void)
 {
-    size_t old_count, new_count;
-    do {
-        old_count = *count;
-        if(old_count == limit)
-            abort();
-        new_count = old_count + val;
-    } while(!__sync_bool_compare_and_swap(count, old_count, new_count));
-    return new_count;
+    __sync_lock_release(&tr24sp__stats_lock);
 }
 
-TR24_INLINE static size_t atomic_increment(volatile size_t *count)
+static void tr24sp__stats_add(tr24sp__s_stats_local *to,
+                              const tr24sp__s_stats_local *from)
 {
-    return atomic_add(count, SIZE_MAX, 1);
+    for(int k = 0; k < TR24_SP_STATS_KINDS; ++k) {
+        to->allocs[k] += from->allocs[k];
+        to->frees[k] += from->frees[k];
+        to->alloc_bytes[k] += from->alloc_bytes[k];
+        to->free_bytes[k] += from->free_bytes[k];
+    }
+    for(int i = 0; i < TR24SP_STATS_BUCKETS; ++i)
+        to->size_hist[i] += from->size_hist[i];
+    to->ref_inc += from->ref_inc;
+    to->ref_dec += from->ref_dec;
+    to->dtor_calls += from->dtor_calls;
+    to->dtor_ns += from->dtor_ns;
 }
 
-TR24_INLINE static size_t atomic_decrement(volatile size_t *count)
+static void tr24sp__stats_thread_exit(void *arg)
 {
-    return atomic_add(count, 0, -1);
+    tr24sp__s_stats_local *local = (tr24sp__s_stats_local *)arg;
+    tr24sp__stats_acquire();
+    tr24sp__s_stats_local **link = &tr24sp__stats_threads;
+    while(*link != local)
+        link = &(*link)->next;
+    *link = local->next;
+    tr24sp__stats_add(&tr24sp__stats_retired, local);
+    tr24sp__stats_release();
+    tr24sp__stats_local = NULL;
+    TR24_FREE(local);
 }
 
-TR24_INLINE void *tr24sp__get_smart_ptr_meta(void *ptr)
+static void tr24sp__stats_init(void)
 {
-    TR24_ASSERT((size_t)ptr == tr24sp__align((size_t)ptr));
+    pthread_key_create(&tr24sp__stats_key, tr24sp__stats_thread_exit);
+}
 
-    tr24sp__s_meta *meta = tr24sp__get_meta(ptr);
-    TR24_ASSERT(meta->ptr == ptr);
+static tr24sp__s_stats_local *tr24sp__stats_register(void)
+{
+    pthread_once(&tr24sp__stats_once, tr24sp__stats_init);
+    tr24sp__s_stats_local *local =
+        (tr24sp__s_stats_local *)TR24_MALLOC(sizeof(*local));
+    if(local == NULL)
+        return &tr24sp__stats_spare;
+    TR24_MEMSET(local, 0, sizeof(*local));
+    tr24sp__stats_acquire();
+    local->next = tr24sp__stats_threads;
+    tr24sp__stats_threads = local;
+    tr24sp__stats_release();
+    pthread_setspecific(tr24sp__stats_key, local);
+    return tr24sp__stats_local = local;
+}
 
-    size_t head_size = meta->kind & TR24_SP_SHARED ?
-                           sizeof(tr24sp__s_meta_shared) :
-                           sizeof(tr24sp__s_meta);
-    size_t *metasize = (size_t *)ptr - 1;
-    if(*metasize == head_size)
-        return NULL;
+TR24_INLINE static tr24sp__s_stats_local *tr24sp__stats_self(void)
+{
+    tr24sp__s_stats_local *local = tr24sp__stats_local;
+    return local ? local : tr24sp__stats_register();
+}
 
-    return (char *)meta + head_size;
+TR24_INLINE static int tr24sp__stats_kind(int kind)
+{
+    if(kind & TR24_SP_ARRAY)
+        return TR24_SP_STATS_ARRAY;
+    return kind & TR24_SP_SHARED ? TR24_SP_STATS_SHARED :
+                                   TR24_SP_STATS_UNIQUE;
 }
 
-void *tr24sp__sref(void *ptr)
+/* compact entries keep their tag in front of everything else */
+#define TR24SP_COMPACT_STATS_SIZE sizeof(tr24sp__s_stats_tag)
+
+TR24_INLINE static tr24sp__s_stats_tag *tr24sp__stats_of(void *ptr)
 {
-    tr24sp__s_meta *meta = tr24sp__get_meta(ptr);
-    TR24_ASSERT(meta->ptr == ptr);
-    TR24_ASSERT(meta->kind & TR24_SP_SHARED);
-    atomic_increment(&((tr24sp__s_meta_shared *)meta)->ref_count);
-    return ptr;
+    if(!tr24sp__is_compact(ptr))
+        return &tr24sp__get_meta(ptr)->stats;
+    char *base = (char *)tr24sp__compact_meta(ptr);
+    if(base == NULL)
+        base = (char *)tr24sp__compact_word(ptr);
+    return (tr24sp__s_stats_tag *)base - 1;
 }
 
-void *tr24sp__smove_size(void *ptr, size_t size)
+void tr24sp__stats_here(struct tr24sp__s_stats_site *site)
 {
-    tr24sp__s_meta *meta = tr24sp__get_meta(ptr);
-    TR24_ASSERT(meta->kind & TR24_SP_UNIQUE);
+    if(!site->registered &&
+       __sync_bool_compare_and_swap(&site->registered, 0, 1)) {
+        struct tr24sp__s_stats_site *head;
+        do {
+            head = tr24sp__stats_site_list;
+            site->next = head;
+        } while(!__sync_bool_compare_and_swap(&tr24sp__stats_site_list, head,
+                                              site));
+    }
+    tr24sp__stats_site = site;
+}
 
-    tr24sp__s_smalloc_args args;
+/* the call site set by the allocation macros is used up by the next
+ * allocation; a NULL tag just drops it */
+static void tr24sp__stats_alloc(tr24sp__s_stats_tag *tag, int kind,
+                                size_t bytes)
+{
+    struct tr24sp__s_stats_site *site = tr24sp__stats_site;
+    tr24sp__stats_site = NULL;
+    if(tag == NULL)
+        return;
 
-    size_t *metasize = (size_t *)ptr - 1;
-    if(meta->kind & TR24_SP_ARRAY) {
-        tr24sp__s_meta_array *arr_meta =
-            (tr24sp__s_meta_array *)tr24sp__get_smart_ptr_meta(ptr);
-        args = (tr24sp__s_smalloc_args){
-            .size = arr_meta->size * arr_meta->nmemb,
-            .kind = (enum tr24sp__pointer)(TR24_SP_SHARED | TR24_SP_ARRAY),
-            .dtor = meta->dtor,
-            .meta = { arr_meta, *metasize },
-        };
-    } else {
-        void *user_meta = tr24sp__get_smart_ptr_meta(ptr);
-        args = (tr24sp__s_smalloc_args){
-            .size = size,
-            .kind = TR24_SP_SHARED,
-            .dtor = meta->dtor,
-            .meta = { user_meta, *metasize },
-        };
+    tr24sp__s_stats_local *local = tr24sp__stats_self();
+    const int k = tr24sp__stats_kind(kind);
+    local->allocs[k]++;
+    local->alloc_bytes[k] += bytes;
+    int bucket = bytes <= 1 ? 0 : 64 - __builtin_clzll(bytes - 1);
+    local->size_hist[bucket < TR24SP_STATS_BUCKETS ?
+                         bucket :
+                         TR24SP_STATS_BUCKETS - 1]++;
+
+    tag->bytes = bytes;
+    tag->site = site;
+    if(site) {
+        __sync_fetch_and_add(&site->allocs, 1);
+        __sync_fetch_and_add(&site->bytes, bytes);
+        __sync_fetch_and_add(&site->live_bytes, bytes);
     }
-
-    void *newptr = tr24sp__smalloc(&args);
-    TR24_MEMCPY(newptr, ptr, size);
-    return newptr;
 }
 
-TR24_MALLOC_API
-TR24_INLINE static void *tr24sp__alloc_entry(size_t head, size_t size,
-                                             size_t metasize)
+static void tr24sp__stats_free(tr24sp__s_stats_tag *tag, int kind)
 {
-    const size_t totalsize = head + size + metasize + sizeof(size_t);
-#ifdef SMALLOC_FIXED_ALLOCATOR
-    return TR24_MALLOC(totalsize);
-#else /* !SMALLOC_FIXED_ALLOCATOR */
-    return tr24__smalloc_allocator.alloc(totalsize);
-#endif /* !SMALLOC_FIXED_ALLOCATOR */
+    tr24sp__s_stats_local *local = tr24sp__stats_self();
+    const int k = tr24sp__stats_kind(kind);
+    local->frees[k]++;
+    local->free_bytes[k] += tag->bytes;
+    if(tag->site) {
+        __sync_fetch_and_add(&tag->site->frees, 1);
+        __sync_fetch_and_sub(&tag->site->live_bytes, tag->bytes);
+    }
 }
 
-TR24_INLINE static void tr24sp__dealloc_entry(tr24sp__s_meta *meta, void *ptr)
+static void tr24sp__stats_resize(tr24sp__s_stats_tag *tag, int kind,
+                                 size_t bytes)
 {
-    if(meta->dtor) {
-        void *user_meta =
-            (tr24sp__s_meta_array *)tr24sp__get_smart_ptr_meta(ptr);
-        if(meta->kind & TR24_SP_ARRAY) {
-            tr24sp__s_meta_array *arr_meta =
-                (tr24sp__s_meta_array *)((void *)(meta + 1));
-            for(size_t i = 0; i < arr_meta->nmemb; ++i)
-                meta->dtor((char *)ptr + arr_meta->size * i, arr_meta + 1);
-        } else
-            meta->dtor(ptr, user_meta);
+    tr24sp__s_stats_local *local = tr24sp__stats_self();
+    const int k = tr24sp__stats_kind(kind);
+    if(bytes > tag->bytes)
+        local->alloc_bytes[k] += bytes - tag->bytes;
+    else
+        local->free_bytes[k] += tag->bytes - bytes;
+    if(tag->site) {
+        __sync_fetch_and_add(&tag->site->live_bytes, bytes - tag->bytes);
+        if(bytes > tag->bytes)
+            __sync_fetch_and_add(&tag->site->bytes, bytes - tag->bytes);
     }
+    tag->bytes = bytes;
+}
+
+/* entries made on behalf of another one, like a moved array, are counted
+ * against the site of the original */
+TR24_INLINE static void tr24sp__stats_inherit(tr24sp__s_stats_tag *tag)
+{
+    tr24sp__stats_site = tag->site;
+}
+
+#define tr24sp__stats_ref(field) (tr24sp__stats_self()->field++)
+
+TR24_INLINE static uint64_t tr24sp__stats_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#else
+    /* strict ISO modes, processor time is close enough for destructors */
+    return (uint64_t)clock() * (1000000000u / CLOCKS_PER_SEC);
+#endif /* CLOCK_MONOTONIC */
+}
+
+TR24_INLINE static void tr24sp__stats_dtor(uint64_t start)
+{
+    tr24sp__s_stats_local *local = tr24sp__stats_self();
+    local->dtor_calls++;
+    local->dtor_ns += tr24sp__stats_now() - start;
+}
+
+void tr24sp__stats_snapshot(tr24_sp_stats *out)
+{
+    tr24sp__s_stats_local sum;
+    tr24sp__stats_acquire();
+    sum = tr24sp__stats_retired;
+    for(tr24sp__s_stats_local *l = tr24sp__stats_threads; l; l = l->next)
+        tr24sp__stats_add(&sum, l);
+    tr24sp__stats_release();
+
+    for(int k = 0; k < TR24_SP_STATS_KINDS; ++k) {
+        out->allocs[k] = sum.allocs[k];
+        out->frees[k] = sum.frees[k];
+        out->live_objects[k] = sum.allocs[k] - sum.frees[k];
+        out->live_bytes[k] = sum.alloc_bytes[k] - sum.free_bytes[k];
+    }
+    TR24_MEMCPY(out->size_hist, sum.size_hist, sizeof(out->size_hist));
+    out->ref_inc = sum.ref_inc;
+    out->ref_dec = sum.ref_dec;
+    out->dtor_calls = sum.dtor_calls;
+    out->dtor_ns = sum.dtor_ns;
+}
+
+static int tr24sp__stats_site_cmp(const void *a, const void *b)
+{
+    const size_t x = ((const tr24_sp_site_stats *)a)->allocs,
+                 y = ((const tr24_sp_site_stats *)b)->allocs;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+size_t tr24sp__stats_sites(tr24_sp_site_stats *out, size_t max)
+{
+    size_t count = 0;
+    for(struct tr24sp__s_stats_site *s = tr24sp__stats_site_list; s;
+        s = s->next)
+        ++count;
+    tr24_sp_site_stats *all =
+        (tr24_sp_site_stats *)TR24_MALLOC(count * sizeof(*all) + 1);
+    if(all == NULL)
+        return 0;
+
+    /* sites pushed after the count was taken are left for the next call */
+    size_t n = 0;
+    for(struct tr24sp__s_stats_site *s = tr24sp__stats_site_list;
+        s && n < count; s = s->next)
+        all[n++] = *s;
+    qsort(all, n, sizeof(*all), tr24sp__stats_site_cmp);
+    if(n > max)
+        n = max;
+    TR24_MEMCPY(out, all, n * sizeof(*all));
+    TR24_FREE(all);
+    return n;
+}
+
+void tr24sp__stats_dump(FILE *out, size_t max_sites)
+{
+    static const char *const names[TR24_SP_STATS_KINDS] = { "unique", "shared",
+                                                            "array" };
+    tr24_sp_stats stats;
+    tr24sp__stats_snapshot(&stats);
+
+    fprintf(out, "%-8s %12s %12s %12s %14s\n", "kind", "allocs", "frees",
+            "live", "live bytes");
+    for(int k = 0; k < TR24_SP_STATS_KINDS; ++k)
+        fprintf(out, "%-8s %12zu %12zu %12zu %14zu\n", names[k],
+                stats.allocs[k], stats.frees[k], stats.live_objects[k],
+                stats.live_bytes[k]);
+    fprintf(out, "refs +%zu -%zu, %zu dtor calls in %llu ns\n", stats.ref_inc,
+            stats.ref_dec, stats.dtor_calls,
+            (unsigned long long)stats.dtor_ns);
+    for(int i = 0; i < TR24SP_STATS_BUCKETS; ++i)
+        if(stats.size_hist[i])
+            fprintf(out, "<= %-12zu %12zu\n", (size_t)1 << i,
+                    stats.size_hist[i]);
+
+    if(max_sites == 0)
+        return;
+    tr24_sp_site_stats *sites =
+        (tr24_sp_site_stats *)TR24_MALLOC(max_sites * sizeof(*sites));
+    if(sites == NULL)
+        return;
+    const size_t n = tr24sp__stats_sites(sites, max_sites);
+    for(size_t i = 0; i < n; ++i)
+        fprintf(out, "%s:%d %zu allocs, %zu frees, %zu bytes, %zu live\n",
+                sites[i].file, sites[i].line, sites[i].allocs, sites[i].frees,
+                sites[i].bytes, sites[i].live_bytes);
+    TR24_FREE(sites);
+}
+#else
+#define TR24SP_COMPACT_STATS_SIZE 0
+#define tr24sp__stats_of(ptr) NULL
+#define tr24sp__stats_alloc(tag, kind, bytes) ((void)0)
+#define tr24sp__stats_free(tag, kind) ((void)0)
+#define tr24sp__stats_resize(tag, kind, bytes) ((void)0)
+#define tr24sp__stats_inherit(tag) ((void)0)
+#define tr24sp__stats_ref(field) ((void)0)
+#define tr24sp__stats_now() ((uint64_t)0)
+#define tr24sp__stats_dtor(start) ((void)(start))
+#endif /* TR24_SMARTPTR_STATS */
+
+#ifdef TR24_SMARTPTR_POOL
+#include <pthread.h>
+
+#ifndef TR24SP_POOL_SLAB
+#define TR24SP_POOL_SLAB (64 * 1024)
+#endif /* TR24SP_POOL_SLAB */
+
+#ifndef TR24SP_POOL_BATCH
+#define TR24SP_POOL_BATCH 64
+#endif /* TR24SP_POOL_BATCH */
+
+#ifndef TR24SP_POOL_CACHE_MAX
+#define TR24SP_POOL_CACHE_MAX (4 * TR24SP_POOL_BATCH)
+#endif /* TR24SP_POOL_CACHE_MAX */
+
+/* classes are 16 byte steps of block size, block = 8 byte head + user size */
+#define TR24SP_POOL_GRANULE 16
+#define TR24SP_POOL_CLASSES 32
+#define TR24SP_POOL_LARGE UINT32_MAX
+#define TR24SP_POOL_MAGIC 0x7247504fu
+
+typedef struct {
+    uint32_t cls;
+    uint32_t magic;
+} tr24sp__s_pool_head;
+
+typedef struct tr24sp__s_pool_node {
+    struct tr24sp__s_pool_node *next;
+} tr24sp__s_pool_node;
+
+typedef struct {
+    volatile int lock;
+    tr24sp__s_pool_node *head;
+    size_t count;
+} tr24sp__s_pool_central;
+
+typedef struct {
+    tr24sp__s_pool_node *free[TR24SP_POOL_CLASSES];
+    size_t count[TR24SP_POOL_CLASSES];
+    char *slab[TR24SP_POOL_CLASSES];
+    char *slab_end[TR24SP_POOL_CLASSES];
+    int registered;
+} tr24sp__s_pool_cache;
+
+static tr24sp__s_pool_central tr24sp__pool_central[TR24SP_POOL_CLASSES];
+static __thread tr24sp__s_pool_cache tr24sp__pool_cache;
+static pthread_key_t tr24sp__pool_key;
+static pthread_once_t tr24sp__pool_once = PTHREAD_ONCE_INIT;
+
+TR24_INLINE static size_t tr24sp__pool_block_size(uint32_t cls)
+{
+    return (size_t)(cls + 1) * TR24SP_POOL_GRANULE;
+}
+
+TR24_INLINE static tr24sp__s_pool_head *tr24sp__pool_head(void *ptr)
+{
+    return (tr24sp__s_pool_head *)ptr - 1;
+}
+
+TR24_INLINE static void tr24sp__pool_lock(tr24sp__s_pool_central *c)
+{
+    while(__sync_lock_test_and_set(&c->lock, 1))
+        while(c->lock)
+            ;
+}
+
+TR24_INLINE static void tr24sp__pool_unlock(tr24sp__s_pool_central *c)
+{
+    __sync_lock_release(&c->lock);
+}
+
+/* hands `n` blocks of the thread cache over to the central list */
+static void tr24sp__pool_spill(tr24sp__s_pool_cache *cache, uint32_t cls,
+                               size_t n)
+{
+    tr24sp__s_pool_node *first = cache->free[cls], *last = first;
+    if(!first || !n)
+        return;
+    size_t moved = 1;
+    while(moved < n && last->next) {
+        last = last->next;
+        ++moved;
+    }
+    cache->free[cls] = last->next;
+    cache->count[cls] -= moved;
+
+    tr24sp__s_pool_central *c = &tr24sp__pool_central[cls];
+    tr24sp__pool_lock(c);
+    last->next = c->head;
+    c->head = first;
+    c->count += moved;
+    tr24sp__pool_unlock(c);
+}
+
+static void tr24sp__pool_thread_exit(void *arg)
+{
+    tr24sp__s_pool_cache *cache = (tr24sp__s_pool_cache *)arg;
+    for(uint32_t cls = 0; cls < TR24SP_POOL_CLASSES; ++cls)
+        tr24sp__pool_spill(cache, cls, cache->count[cls]);
+    /* the unused slab tails are lost, slabs are never handed back */
+    cache->registered = 0;
+}
+
+static void tr24sp__pool_init(void)
+{
+    pthread_key_create(&tr24sp__pool_key, tr24sp__pool_thread_exit);
+}
+
+TR24_INLINE static tr24sp__s_pool_cache *tr24sp__pool_get_cache(void)
+{
+    tr24sp__s_pool_cache *cache = &tr24sp__pool_cache;
+    if(__builtin_expect(!cache->registered, 0)) {
+        pthread_once(&tr24sp__pool_once, tr24sp__pool_init);
+        pthread_setspecific(tr24sp__pool_key, cache);
+        cache->registered = 1;
+    }
+    return cache;
+}
+
+static tr24sp__s_pool_node *tr24sp__pool_refill(tr24sp__s_pool_cache *cache,
+                                                uint32_t cls)
+{
+    /* first take back whatever other threads spilled */
+    tr24sp__s_pool_central *c = &tr24sp__pool_central[cls];
+    if(c->head) {
+        tr24sp__pool_lock(c);
+        tr24sp__s_pool_node *first = c->head, *last = first;
+        size_t moved = first ? 1 : 0;
+        while(last && moved < TR24SP_POOL_BATCH && last->next) {
+            last = last->next;
+            ++moved;
+        }
+        if(first) {
+            c->head = last->next;
+            c->count -= moved;
+            last->next = NULL;
+        }
+        tr24sp__pool_unlock(c);
+        if(first) {
+            cache->free[cls] = first;
+            cache->count[cls] += moved;
+            return first;
+        }
+    }
+
+    /* then carve a batch out of this thread's slab for the class */
+    const size_t bsize = tr24sp__pool_block_size(cls);
+    if((size_t)(cache->slab_end[cls] - cache->slab[cls]) < bsize) {
+        char *slab = (char *)TR24_MALLOC(TR24SP_POOL_SLAB);
+        if(slab == NULL)
+            return NULL;
+        /* blocks start 8 bytes into the slab so user pointers are 16 byte
+         * aligned like malloc's */
+        cache->slab[cls] = slab + sizeof(tr24sp__s_pool_head);
+        cache->slab_end[cls] = slab + TR24SP_POOL_SLAB;
+    }
+
+    tr24sp__s_pool_node *head = NULL, **tail = &head;
+    size_t n = 0;
+    while(n < TR24SP_POOL_BATCH &&
+          (size_t)(cache->slab_end[cls] - cache->slab[cls]) >= bsize) {
+        tr24sp__s_pool_head *h = (tr24sp__s_pool_head *)cache->slab[cls];
+        *h = (tr24sp__s_pool_head){ .cls = cls, .magic = TR24SP_POOL_MAGIC };
+        tr24sp__s_pool_node *node = (tr24sp__s_pool_node *)(h + 1);
+        *tail = node;
+        tail = &node->next;
+        cache->slab[cls] += bsize;
+        ++n;
+    }
+    *tail = NULL;
+    cache->free[cls] = head;
+    cache->count[cls] += n;
+    return head;
+}
+
+void *tr24sp__pool_alloc(size_t size)
+{
+    const size_t bsize = size + sizeof(tr24sp__s_pool_head);
+    if(bsize > TR24SP_POOL_CLASSES * TR24SP_POOL_GRANULE) {
+        char *raw = (char *)TR24_MALLOC(size + 2 * sizeof(tr24sp__s_pool_head));
+        if(raw == NULL)
+            return NULL;
+        tr24sp__s_pool_head *h = (tr24sp__s_pool_head *)raw + 1;
+        *h = (tr24sp__s_pool_head){ .cls = TR24SP_POOL_LARGE,
+                                    .magic = TR24SP_POOL_MAGIC };
+        return h + 1;
+    }
+
+    const uint32_t cls =
+        (uint32_t)((bsize + TR24SP_POOL_GRANULE - 1) / TR24SP_POOL_GRANULE) - 1;
+    tr24sp__s_pool_cache *cache = tr24sp__pool_get_cache();
+    tr24sp__s_pool_node *node = cache->free[cls];
+    if(__builtin_expect(node == NULL, 0)) {
+        node = tr24sp__pool_refill(cache, cls);
+        if(node == NULL)
+            return NULL;
+    }
+    cache->free[cls] = node->next;
+    --cache->count[cls];
+    return node;
+}
+
+void tr24sp__pool_dealloc(void *ptr)
+{
+    if(!ptr)
+        return;
+    tr24sp__s_pool_head *h = tr24sp__pool_head(ptr);
+    TR24_ASSERT(h->magic == TR24SP_POOL_MAGIC);
+    if(h->cls == TR24SP_POOL_LARGE) {
+        TR24_FREE(h - 1);
+        return;
+    }
+
+    tr24sp__s_pool_cache *cache = tr24sp__pool_get_cache();
+    tr24sp__s_pool_node *node = (tr24sp__s_pool_node *)ptr;
+    node->next = cache->free[h->cls];
+    cache->free[h->cls] = node;
+    if(++cache->count[h->cls] > TR24SP_POOL_CACHE_MAX)
+        tr24sp__pool_spill(cache, h->cls, TR24SP_POOL_BATCH);
+}
+
+void *tr24sp__pool_realloc(void *ptr, size_t size)
+{
+    if(!ptr)
+        return tr24sp__pool_alloc(size);
+    tr24sp__s_pool_head *h = tr24sp__pool_head(ptr);
+    TR24_ASSERT(h->magic == TR24SP_POOL_MAGIC);
+    size_t old_size;
+    if(h->cls == TR24SP_POOL_LARGE) {
+        if(size + sizeof(tr24sp__s_pool_head) >
+           TR24SP_POOL_CLASSES * TR24SP_POOL_GRANULE) {
+            char *raw = (char *)TR24_REALLOC(
+                h - 1, size + 2 * sizeof(tr24sp__s_pool_head));
+            return raw ? raw + 2 * sizeof(tr24sp__s_pool_head) : NULL;
+        }
+        old_size = size;
+    } else {
+        old_size = tr24sp__pool_block_size(h->cls) - sizeof(tr24sp__s_pool_head);
+        /* still fits the block it's in */
+        if(size <= old_size)
+            return ptr;
+    }
+
+    void *newptr = tr24sp__pool_alloc(size);
+    if(newptr == NULL)
+        return NULL;
+    TR24_MEMCPY(newptr, ptr, old_size < size ? old_size : size);
+    tr24sp__pool_dealloc(ptr);
+    return newptr;
+}
+
+void tr24sp__pool_flush(void)
+{
+    tr24sp__pool_thread_exit(tr24sp__pool_get_cache());
+    tr24sp__pool_cache.registered = 1;
+}
+
+tr24sp__s_allocator tr24__smalloc_pool_allocator = {
+    tr24sp__pool_alloc, tr24sp__pool_dealloc, tr24sp__pool_realloc
+};
+tr24sp__s_allocator tr24__smalloc_allocator = { tr24sp__pool_alloc,
+                                                tr24sp__pool_dealloc,
+                                                tr24sp__pool_realloc };
+#else /* !TR24_SMARTPTR_POOL */
+tr24sp__s_allocator tr24__smalloc_allocator = { TR24_MALLOC, TR24_FREE,
+                                                TR24_REALLOC };
+#endif /* !TR24_SMARTPTR_POOL */
+
+TR24_INLINE static size_t atomic_add(volatile size_t *count, const size_t limit,
+                                     const size_t val)
+{
+#ifdef TR24_SMARTPTR_SINGLE_THREADED
+    if(*count == limit)
+        abort();
+    return *count += val;
+#else
+    size_t old_count, new_count;
+    do {
+        old_count = *count;
+        if(old_count == limit)
+            abort();
+        new_count = old_count + val;
+    } while(!__sync_bool_compare_and_swap(count, old_count, new_count));
+    return new_count;
+#endif /* TR24_SMARTPTR_SINGLE_THREADED */
+}
+
+TR24_INLINE static size_t atomic_increment(volatile size_t *count)
+{
+    return atomic_add(count, SIZE_MAX, 1);
+}
+
+TR24_INLINE static size_t atomic_decrement(volatile size_t *count)
+{
+    return atomic_add(count, 0, -1);
+}
+
+TR24_INLINE static size_t local_add(volatile size_t *count, const size_t limit,
+                                    const size_t val)
+{
+    if(*count == limit)
+        abort();
+    return *count += val;
+}
+
+static tr24sp__s_brc_queue *tr24sp__brc_self(void);
+static void tr24sp__brc_sref(tr24sp__s_meta_biased *meta);
+static size_t tr24sp__brc_sfree(tr24sp__s_meta_biased *meta, void *ptr);
+
+#define TR24SP_SHARD_BIAS ((size_t)1 << (sizeof(size_t) * 8 - 2))
+/* retired shards are set to this, the counts left around it don't matter */
+#define TR24SP_SHARD_DEAD (INTPTR_MIN / 2)
+
+static volatile unsigned tr24sp__shard_next;
+/* shard index of this thread plus one, zero until it first needs one */
+static __thread unsigned tr24sp__shard_self;
+
+TR24_INLINE static volatile intptr_t *
+tr24sp__shard(tr24sp__s_meta_sharded *meta)
+{
+    if(__builtin_expect(tr24sp__shard_self == 0, 0))
+        tr24sp__shard_self = __sync_add_and_fetch(&tr24sp__shard_next, 1);
+    return &meta->shards[(tr24sp__shard_self - 1) % TR24SP_SHARDS].count;
+}
+
+TR24_INLINE static void tr24sp__shard_sref(tr24sp__s_meta_sharded *meta)
+{
+    if(__sync_fetch_and_add(tr24sp__shard(meta), 1) < TR24SP_SHARD_DEAD / 2)
+        atomic_increment(&meta->ref_count);
+}
+
+/* returns zero once the object has to be destroyed */
+TR24_INLINE static size_t tr24sp__shard_sfree(tr24sp__s_meta_sharded *meta)
+{
+    if(__sync_fetch_and_sub(tr24sp__shard(meta), 1) >= TR24SP_SHARD_DEAD / 2)
+        return 1;
+    return atomic_decrement(&meta->ref_count);
+}
+
+TR24_INLINE void *tr24sp__get_smart_ptr_meta(void *ptr)
+{
+    TR24_ASSERT((size_t)ptr == tr24sp__align((size_t)ptr));
+    if(tr24sp__is_compact(ptr))
+        return tr24sp__compact_meta(ptr);
+
+    tr24sp__s_meta *meta = tr24sp__get_meta(ptr);
+    TR24_ASSERT(meta->ptr == ptr);
+
+    size_t head_size = tr24sp__head_size(meta->kind);
+    size_t *metasize = (size_t *)ptr - 1;
+    if(*metasize == head_size)
+        return NULL;
+
+    return (char *)meta + head_size;
+}
+
+void *tr24sp__sref(void *ptr)
+{
+    if(tr24sp__is_compact(ptr)) {
+        tr24sp__compact_sref(ptr);
+        return ptr;
+    }
+    tr24sp__s_meta *meta = tr24sp__get_meta(ptr);
+    TR24_ASSERT(meta->ptr == ptr);
+    TR24_ASSERT(meta->kind & TR24_SP_SHARED);
+    tr24sp__stats_ref(ref_inc);
+    if(meta->kind & TR24_SP_WEAK)
+        atomic_increment(&((tr24sp__s_meta_weak *)meta)->ctrl->strong);
+    else if(meta->kind & TR24_SP_BIASED)
+        tr24sp__brc_sref((tr24sp__s_meta_biased *)meta);
+    else if(meta->kind & TR24_SP_SHARDED)
+        tr24sp__shard_sref((tr24sp__s_meta_sharded *)meta);
+    else if(meta->kind & TR24_SP_LOCAL)
+        local_add(&((tr24sp__s_meta_shared *)meta)->ref_count, SIZE_MAX, 1);
+    else
+        atomic_increment(&((tr24sp__s_meta_shared *)meta)->ref_count);
+    return ptr;
+}
+
+void *tr24sp__smove_size(void *ptr, size_t size)
+{
+    if(tr24sp__is_compact(ptr)) {
+        /* compact headers already have room for the count: the old pointer
+         * and the new one are the two references, both get sfree'd */
+        volatile uint64_t *word = tr24sp__compact_word(ptr);
+        TR24_ASSERT(!(*word & TR24SP_COMPACT_SHARED));
+        tr24sp__stats_free(tr24sp__stats_of(ptr), tr24sp__compact_kind(*word));
+        *word = (*word & (TR24SP_COMPACT_REF_ONE - 1)) |
+                TR24SP_COMPACT_SHARED | 2 * TR24SP_COMPACT_REF_ONE;
+        tr24sp__stats_inherit(tr24sp__stats_of(ptr));
+        tr24sp__stats_alloc(tr24sp__stats_of(ptr), tr24sp__compact_kind(*word),
+                            tr24sp__stats_of(ptr)->bytes);
+        return ptr;
+    }
+    tr24sp__s_meta *meta = tr24sp__get_meta(ptr);
+    TR24_ASSERT(meta->ptr == ptr);
+    TR24_ASSERT(!(meta->kind & TR24_SP_SHARED));
+
+    if(meta->kind & TR24_SP_PROMOTABLE) {
+        /* same as above, only the header changes */
+        tr24sp__stats_free(&meta->stats, meta->kind);
+        meta->kind = (enum tr24sp__pointer)(meta->kind | TR24_SP_SHARED);
+        ((tr24sp__s_meta_shared *)meta)->ref_count = 2;
+        tr24sp__stats_inherit(&meta->stats);
+        tr24sp__stats_alloc(&meta->stats, meta->kind, meta->stats.bytes);
+        return ptr;
+    }
+
+    /* otherwise the payload and user meta are copied into a new shared
+     * entry, which takes over the destructor */
+    tr24sp__s_smalloc_args args;
+    const enum tr24sp__pointer kind = (enum tr24sp__pointer)(
+        TR24_SP_SHARED | (meta->kind & (TR24_SP_BULK | TR24_SP_DEFER)));
+    const size_t metasize =
+        *((size_t *)ptr - 1) - tr24sp__head_size(meta->kind);
+    size_t bytes = size;
+    tr24sp__s_meta_array *arr_meta = NULL;
+    if(meta->kind & TR24_SP_ARRAY) {
+        arr_meta = (tr24sp__s_meta_array *)tr24sp__get_smart_ptr_meta(ptr);
+        bytes = arr_meta->size * arr_meta->nmemb;
+        /* vectors keep their capacity, and an empty one still has to come
+         * back as an array */
+        args = (tr24sp__s_smalloc_args){
+            TR24SP_SENTINEL
+            .size = arr_meta->size,
+            .nmemb = arr_meta->capacity ? arr_meta->capacity : 1,
+            .kind = kind,
+            .dtor = meta->dtor,
+            .meta = { arr_meta + 1, metasize - sizeof(*arr_meta) },
+            .align = 0,
+            .bulk_dtor = NULL,
+        };
+    } else {
+        args = (tr24sp__s_smalloc_args){
+            TR24SP_SENTINEL
+            .size = size,
+            .nmemb = 0,
+            .kind = kind,
+            .dtor = meta->dtor,
+            .meta = { tr24sp__get_smart_ptr_meta(ptr), metasize },
+            .align = 0,
+            .bulk_dtor = NULL,
+        };
+    }
+
+    tr24sp__stats_inherit(&meta->stats);
+    void *newptr = tr24sp__smalloc(&args);
+    if(newptr == NULL)
+        return NULL;
+    TR24_MEMCPY(newptr, ptr, bytes);
+    if(arr_meta) {
+        tr24sp__s_meta_array *new_meta =
+            (tr24sp__s_meta_array *)tr24sp__get_smart_ptr_meta(newptr);
+        new_meta->nmemb = arr_meta->nmemb;
+        new_meta->capacity = args.nmemb;
+    }
+    meta->dtor = NULL;
+    return newptr;
+}
+
+#ifndef TR24SP_REGION_CHUNK
+#define TR24SP_REGION_CHUNK (16 * 1024)
+#endif /* TR24SP_REGION_CHUNK */
+
+#define TR24SP_REGION_ALIGN 16
+
+typedef struct tr24sp__s_region_chunk {
+    struct tr24sp__s_region_chunk *prev;
+    size_t size;
+} tr24sp__s_region_chunk;
+
+typedef struct tr24sp__s_region_dtor {
+    struct tr24sp__s_region_dtor *next;
+    tr24sp__s_meta *meta;
+    void *ptr;
+} tr24sp__s_region_dtor;
+
+struct tr24sp__s_region {
+    struct tr24sp__s_region *parent;
+    char *cur;
+    char *end;
+    size_t chunk_size;
+    tr24sp__s_region_chunk *chunks;
+    tr24sp__s_region_dtor *dtors;
+};
+
+static __thread tr24_region_t *tr24sp__region_current;
+
+TR24_INLINE static size_t tr24sp__region_align(size_t s)
+{
+    return (s + (TR24SP_REGION_ALIGN - 1)) & ~(size_t)(TR24SP_REGION_ALIGN - 1);
+}
+
+static void *tr24sp__region_grow(tr24_region_t *region, size_t size)
+{
+    const size_t head = tr24sp__region_align(sizeof(tr24sp__s_region_chunk));
+    size_t chunk = region->chunk_size;
+    while(chunk < size + head)
+        chunk *= 2;
+    tr24sp__s_region_chunk *c = (tr24sp__s_region_chunk *)TR24_MALLOC(chunk);
+    if(c == NULL)
+        return NULL;
+    c->prev = region->chunks;
+    c->size = chunk;
+    region->chunks = c;
+    /* every new chunk doubles, so big regions need few mallocs */
+    region->chunk_size = chunk * 2;
+
+    char *mem = (char *)c + head;
+    region->cur = mem + size;
+    region->end = (char *)c + chunk;
+    return mem;
+}
+
+TR24_MALLOC_API
+TR24_INLINE static void *tr24sp__region_alloc(tr24_region_t *region,
+                                              size_t size)
+{
+    size = tr24sp__region_align(size);
+    if(__builtin_expect((size_t)(region->end - region->cur) < size, 0))
+        return tr24sp__region_grow(region, size);
+    void *mem = region->cur;
+    region->cur += size;
+    return mem;
+}
+
+tr24_region_t *tr24sp__region_begin(size_t chunk_size)
+{
+    const size_t head = tr24sp__region_align(sizeof(tr24sp__s_region_chunk));
+    const size_t self = tr24sp__region_align(sizeof(tr24_region_t));
+    if(chunk_size < head + self + TR24SP_REGION_ALIGN)
+        chunk_size = TR24SP_REGION_CHUNK;
+
+    /* the region itself lives at the start of its first chunk */
+    tr24sp__s_region_chunk *c =
+        (tr24sp__s_region_chunk *)TR24_MALLOC(chunk_size);
+    if(c == NULL)
+        return NULL;
+    *c = (tr24sp__s_region_chunk){ .prev = NULL, .size = chunk_size };
+
+    tr24_region_t *region = (tr24_region_t *)((char *)c + head);
+    *region = (tr24_region_t){
+        .parent = tr24sp__region_current,
+        .cur = (char *)region + self,
+        .end = (char *)c + chunk_size,
+        .chunk_size = chunk_size * 2,
+        .chunks = c,
+        .dtors = NULL,
+    };
+    tr24sp__region_current = region;
+    return region;
+}
+
+static void tr24sp__run_dtor(tr24sp__s_meta *meta, void *ptr);
+
+void tr24sp__region_end(tr24_region_t *region)
+{
+    if(!region)
+        return;
+    TR24_ASSERT(tr24sp__region_current == region);
+    tr24sp__region_current = region->parent;
+
+    /* dtors are pushed to the front, so this is reverse allocation order */
+    for(tr24sp__s_region_dtor *d = region->dtors; d; d = d->next) {
+        if(d->meta->dtor)
+            tr24sp__run_dtor(d->meta, d->ptr);
+        if(d->meta->kind & TR24_SP_WEAK) {
+            tr24sp__s_meta_weak *weak = (tr24sp__s_meta_weak *)d->meta;
+            if(weak->ctrl) {
+                weak->ctrl->strong = 0;
+                tr24sp__weak_release(weak->ctrl);
+            }
+        }
+    }
+
+    tr24sp__s_region_chunk *c = region->chunks;
+    while(c) {
+        tr24sp__s_region_chunk *prev = c->prev;
+        TR24_FREE(c);
+        c = prev;
+    }
+}
+
+TR24_MALLOC_API
+TR24_INLINE static void *tr24sp__raw_alloc(size_t size)
+{
+#if defined(SMALLOC_FIXED_ALLOCATOR) && defined(TR24_SMARTPTR_POOL)
+    return tr24sp__pool_alloc(size);
+#elif defined(SMALLOC_FIXED_ALLOCATOR)
+    return TR24_MALLOC(size);
+#else /* !SMALLOC_FIXED_ALLOCATOR */
+    return tr24__smalloc_allocator.alloc(size);
+#endif /* !SMALLOC_FIXED_ALLOCATOR */
+}
+
+TR24_INLINE static void tr24sp__raw_dealloc(void *ptr)
+{
+#if defined(SMALLOC_FIXED_ALLOCATOR) && defined(TR24_SMARTPTR_POOL)
+    tr24sp__pool_dealloc(ptr);
+#elif defined(SMALLOC_FIXED_ALLOCATOR)
+    TR24_FREE(ptr);
+#else /* !SMALLOC_FIXED_ALLOCATOR */
+    tr24__smalloc_allocator.dealloc(ptr);
+#endif /* !SMALLOC_FIXED_ALLOCATOR */
+}
+
+TR24_INLINE static void *tr24sp__raw_realloc(void *ptr, size_t size)
+{
+#if defined(SMALLOC_FIXED_ALLOCATOR) && defined(TR24_SMARTPTR_POOL)
+    return tr24sp__pool_realloc(ptr, size);
+#elif defined(SMALLOC_FIXED_ALLOCATOR)
+    return TR24_REALLOC(ptr, size);
+#else /* !SMALLOC_FIXED_ALLOCATOR */
+    if(!tr24__smalloc_allocator.realloc)
+        return NULL;
+    return tr24__smalloc_allocator.realloc(ptr, size);
+#endif /* !SMALLOC_FIXED_ALLOCATOR */
+}
+
+TR24_MALLOC_API
+TR24_INLINE static void *tr24sp__alloc_entry(size_t totalsize)
+{
+    return tr24sp__raw_alloc(totalsize);
+}
+
+#ifndef TR24SP_MMAP_THRESHOLD
+#define TR24SP_MMAP_THRESHOLD (2 * 1024 * 1024)
+#endif /* TR24SP_MMAP_THRESHOLD */
+
+#define TR24SP_HUGE_PAGE ((size_t)2 * 1024 * 1024)
+
+size_t tr24__smalloc_mmap_threshold = TR24SP_MMAP_THRESHOLD;
+
+TR24_INLINE static int tr24sp__wants_map(enum tr24sp__pointer kind,
+                                         size_t size)
+{
+    return kind & TR24_SP_HUGE || (tr24__smalloc_mmap_threshold &&
+                                   size >= tr24__smalloc_mmap_threshold);
+}
+
+/* maps at least *length bytes and tells how much it really did */
+static void *tr24sp__map_entry(size_t *length, int huge)
+{
+#ifdef TR24SP_HAVE_MMAP
+    void *base;
+#ifdef MAP_HUGETLB
+    if(huge) {
+        const size_t rounded =
+            (*length + TR24SP_HUGE_PAGE - 1) & ~(TR24SP_HUGE_PAGE - 1);
+        base = mmap(NULL, rounded, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(base != MAP_FAILED) {
+            *length = rounded;
+            return base;
+        }
+    }
+#else
+    (void)huge;
+#endif /* MAP_HUGETLB */
+    base = mmap(NULL, *length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    if(huge)
+        madvise(base, *length, MADV_HUGEPAGE);
+#endif /* MADV_HUGEPAGE */
+    return base;
+#else
+    (void)length;
+    (void)huge;
+    return NULL;
+#endif /* TR24SP_HAVE_MMAP */
+}
+
+TR24_INLINE static void *tr24sp__entry_base(tr24sp__s_meta *meta)
+{
+    if(meta->kind & (TR24_SP_ALIGNED | TR24_SP_MAPPED))
+        return ((tr24sp__s_prefix *)meta - 1)->base;
+    return meta;
+}
+
+/* counts the members of a batch still alive, sits in front of the first */
+typedef struct {
+    volatile size_t live;
+} tr24sp__s_batch;
+
+TR24_INLINE static void tr24sp__batch_release(tr24sp__s_batch *slab,
+                                              size_t count)
+{
+    if(slab && __sync_sub_and_fetch(&slab->live, count) == 0)
+        tr24sp__raw_dealloc(slab);
+}
+
+TR24_INLINE static void tr24sp__free_entry(tr24sp__s_meta *meta)
+{
+    if(meta->kind & TR24_SP_BATCH) {
+        tr24sp__batch_release(
+            (tr24sp__s_batch *)((tr24sp__s_prefix *)meta - 1)->base, 1);
+        return;
+    }
+#ifdef TR24SP_HAVE_MMAP
+    if(meta->kind & TR24_SP_MAPPED) {
+        tr24sp__s_prefix *prefix = (tr24sp__s_prefix *)meta - 1;
+        munmap(prefix->base, prefix->length);
+        return;
+    }
+#endif /* TR24SP_HAVE_MMAP */
+    tr24sp__raw_dealloc(tr24sp__entry_base(meta));
+}
+
+/* arrays call the destructor once per element, or a bulk destructor once
+ * for all of them */
+static void tr24sp__destroy(tr24sp__f_destruct dtor, int kind, void *ptr,
+                            void *user_meta)
+{
+    const uint64_t start = tr24sp__stats_now();
+    tr24sp__f_bulk_destruct bulk =
+        (tr24sp__f_bulk_destruct)(void (*)(void))dtor;
+    if(kind & TR24_SP_ARRAY) {
+        tr24sp__s_meta_array *arr_meta = (tr24sp__s_meta_array *)user_meta;
+        if(kind & TR24_SP_BULK)
+            bulk(ptr, arr_meta->nmemb, arr_meta->size, arr_meta + 1);
+        else
+            for(size_t i = 0; i < arr_meta->nmemb; ++i)
+                dtor((char *)ptr + arr_meta->size * i, arr_meta + 1);
+    } else if(kind & TR24_SP_BULK)
+        bulk(ptr, 1, 0, user_meta);
+    else
+        dtor(ptr, user_meta);
+    tr24sp__stats_dtor(start);
+}
+
+static void tr24sp__run_dtor(tr24sp__s_meta *meta, void *ptr)
+{
+    tr24sp__destroy(meta->dtor, meta->kind, ptr,
+                    tr24sp__get_smart_ptr_meta(ptr));
+}
+
+TR24_INLINE static void tr24sp__release_entry(tr24sp__s_meta *meta, void *ptr)
+{
+    if(meta->dtor)
+        tr24sp__run_dtor(meta, ptr);
+    if(meta->kind & TR24_SP_SHARDED)
+        tr24sp__raw_dealloc(((tr24sp__s_meta_sharded *)meta)->shards_base);
+
+    /* region memory is released by tr24_region_end, only mark it dead */
+    if(meta->kind & TR24_SP_REGION) {
+        meta->dtor = NULL;
+        return;
+    }
+
+    tr24sp__stats_free(&meta->stats, meta->kind);
+    tr24sp__free_entry(meta);
+}
+
+/* payload pointers of deferred objects, linked through meta->ptr */
+static void *volatile tr24sp__defer_head;
+
+TR24_INLINE static void tr24sp__dealloc_entry(tr24sp__s_meta *meta, void *ptr)
+{
+    if(meta->kind & TR24_SP_DEFER && !(meta->kind & TR24_SP_REGION)) {
+        void *head;
+        do {
+            head = tr24sp__defer_head;
+            meta->ptr = head;
+        } while(!__sync_bool_compare_and_swap(&tr24sp__defer_head, head, ptr));
+        return;
+    }
+    tr24sp__release_entry(meta, ptr);
+}
+
+int tr24sp__register_dtor(tr24sp__f_destruct dtor)
+{
+    if(!dtor)
+        return 0;
+    int count = tr24sp__dtor_count;
+    for(int i = 1; i < count; ++i)
+        if(tr24sp__dtor_table[i] == dtor)
+            return i;
+
+    while(__sync_lock_test_and_set(&tr24sp__dtor_lock, 1))
+        while(tr24sp__dtor_lock)
+            ;
+    count = tr24sp__dtor_count;
+    int index = -1;
+    for(int i = 1; i < count; ++i)
+        if(tr24sp__dtor_table[i] == dtor)
+            index = i;
+    if(index < 0 && count < TR24SP_DTOR_TABLE) {
+        tr24sp__dtor_table[count] = dtor;
+        __sync_synchronize();
+        tr24sp__dtor_count = count + 1;
+        index = count;
+    }
+    __sync_lock_release(&tr24sp__dtor_lock);
+    return index;
+}
 
-#ifdef SMALLOC_FIXED_ALLOCATOR
-    TR24_FREE(meta);
-#else /* !SMALLOC_FIXED_ALLOCATOR */
-    tr24__smalloc_allocator.dealloc(meta);
-#endif /* !SMALLOC_FIXED_ALLOCATOR */
+TR24_MALLOC_API
+static void *tr24sp__smalloc_compact(tr24sp__s_smalloc_args *args, int dtor)
+{
+    const size_t aligned_metasize = tr24sp__align(args->meta.size);
+    const size_t prefix =
+        args->meta.size ? aligned_metasize + sizeof(size_t) : 0;
+    char *base = (char *)tr24sp__alloc_entry(
+        TR24SP_COMPACT_STATS_SIZE + prefix + sizeof(uint64_t) +
+        tr24sp__align(args->size));
+    if(base == NULL)
+        return NULL;
+    base += TR24SP_COMPACT_STATS_SIZE;
+
+    uint64_t word = TR24SP_COMPACT_TAG |
+                    (uint64_t)dtor << TR24SP_COMPACT_DTOR_SHIFT;
+    if(args->kind & TR24_SP_SHARED)
+        word |= TR24SP_COMPACT_SHARED | TR24SP_COMPACT_REF_ONE;
+    if(args->kind & TR24_SP_LOCAL)
+        word |= TR24SP_COMPACT_LOCAL;
+    if(args->kind & TR24_SP_ARRAY)
+        word |= TR24SP_COMPACT_ARRAY;
+    if(args->kind & TR24_SP_BULK)
+        word |= TR24SP_COMPACT_BULK;
+    if(prefix) {
+        word |= TR24SP_COMPACT_META;
+        if(args->meta.data)
+            TR24_MEMCPY(base, args->meta.data, args->meta.size);
+        *(size_t *)(base + aligned_metasize) = aligned_metasize;
+    }
+
+    uint64_t *header = (uint64_t *)(base + prefix);
+    *header = word;
+    tr24sp__stats_alloc(tr24sp__stats_of(header + 1), args->kind, args->size);
+    return header + 1;
+}
+
+static void tr24sp__compact_sref(void *ptr)
+{
+    volatile uint64_t *word = tr24sp__compact_word(ptr);
+    TR24_ASSERT(*word & TR24SP_COMPACT_SHARED);
+    tr24sp__stats_ref(ref_inc);
+    if(*word >= ~(TR24SP_COMPACT_REF_ONE - 1))
+        abort();
+    if(*word & TR24SP_COMPACT_LOCAL)
+        *word += TR24SP_COMPACT_REF_ONE;
+    else
+        __sync_fetch_and_add(word, TR24SP_COMPACT_REF_ONE);
+}
+
+static void tr24sp__compact_sfree(void *ptr)
+{
+    volatile uint64_t *word = tr24sp__compact_word(ptr);
+    uint64_t value = *word;
+    if(value & TR24SP_COMPACT_SHARED) {
+        TR24_ASSERT(value >= TR24SP_COMPACT_REF_ONE);
+        tr24sp__stats_ref(ref_dec);
+        if(value & TR24SP_COMPACT_LOCAL)
+            value = *word -= TR24SP_COMPACT_REF_ONE;
+        else
+            value = __sync_sub_and_fetch(word, TR24SP_COMPACT_REF_ONE);
+        if(value >= TR24SP_COMPACT_REF_ONE)
+            return;
+    }
+
+    tr24sp__f_destruct dtor = tr24sp__compact_dtor(value);
+    void *user_meta = tr24sp__compact_meta(ptr);
+    if(dtor)
+        tr24sp__destroy(dtor, tr24sp__compact_kind(value), ptr, user_meta);
+    tr24sp__stats_free(tr24sp__stats_of(ptr), tr24sp__compact_kind(value));
+    tr24sp__raw_dealloc((char *)(user_meta ? user_meta : (void *)word) -
+                        TR24SP_COMPACT_STATS_SIZE);
 }
 
 TR24_MALLOC_API
@@ -457,17 +2379,78 @@ static void *tr24sp__smalloc_impl(tr24sp__s_smalloc_args *args)
     if(!args->size)
         return NULL;
 
+#if SIZE_MAX == UINT64_MAX
+    if(args->kind & TR24_SP_COMPACT && args->align <= TR24SP_MIN_ALIGN &&
+       !(args->kind & (TR24_SP_WEAK | TR24_SP_BIASED | TR24_SP_DEFER |
+                       TR24_SP_SHARDED)) &&
+       !tr24sp__region_current &&
+       !tr24sp__wants_map(args->kind, args->size)) {
+        const int dtor = tr24sp__register_dtor(args->dtor);
+        if(dtor >= 0)
+            return tr24sp__smalloc_compact(args, dtor);
+    }
+#endif /* SIZE_MAX == UINT64_MAX */
+
     size_t aligned_metasize = tr24sp__align(args->meta.size);
     size_t size = tr24sp__align(args->size);
 
-    size_t head_size = args->kind & TR24_SP_SHARED ?
-                           sizeof(tr24sp__s_meta_shared) :
-                           sizeof(tr24sp__s_meta);
-    tr24sp__s_meta_shared *ptr = (tr24sp__s_meta_shared *)tr24sp__alloc_entry(
-        head_size, size, aligned_metasize);
-    if(ptr == NULL)
+    /* a compact request that ends up here keeps what compact would have
+     * given it: becoming shared in place, without copying the payload */
+    enum tr24sp__pointer kind = args->kind;
+    if(!(kind & TR24_SP_SHARED) &&
+       (args->size >= TR24SP_PROMOTE_THRESHOLD || kind & TR24_SP_COMPACT))
+        kind = (enum tr24sp__pointer)(kind | TR24_SP_PROMOTABLE);
+    if(kind & TR24_SP_SHARDED &&
+       (!(kind & TR24_SP_SHARED) ||
+        kind & (TR24_SP_WEAK | TR24_SP_BIASED | TR24_SP_LOCAL) ||
+        tr24sp__region_current))
+        kind = (enum tr24sp__pointer)(kind & ~TR24_SP_SHARDED);
+
+    size_t head_size = tr24sp__head_size(kind);
+    size_t entry_size = head_size + aligned_metasize + sizeof(size_t);
+    size_t total_size = entry_size + size;
+    if(args->align > TR24SP_MIN_ALIGN) {
+        TR24_ASSERT(!(args->align & (args->align - 1)));
+        kind = (enum tr24sp__pointer)(kind | TR24_SP_ALIGNED);
+        total_size += sizeof(tr24sp__s_prefix) + args->align - 1;
+    }
+
+    tr24_region_t *region = tr24sp__region_current;
+    char *base = NULL;
+    if(region) {
+        kind = (enum tr24sp__pointer)(kind | TR24_SP_REGION);
+        base = (char *)tr24sp__region_alloc(region, total_size);
+    } else {
+        if(tr24sp__wants_map(kind, args->size)) {
+            size_t length = total_size;
+            if(!(kind & TR24_SP_ALIGNED))
+                length += sizeof(tr24sp__s_prefix);
+            base = (char *)tr24sp__map_entry(&length, kind & TR24_SP_HUGE);
+            if(base) {
+                kind = (enum tr24sp__pointer)(kind | TR24_SP_MAPPED);
+                total_size = length;
+            }
+        }
+        if(base == NULL)
+            base = (char *)tr24sp__alloc_entry(total_size);
+    }
+    if(base == NULL)
         return NULL;
 
+    tr24sp__s_meta_shared *ptr = (tr24sp__s_meta_shared *)base;
+    if(kind & (TR24_SP_ALIGNED | TR24_SP_MAPPED)) {
+        /* the header goes right before the aligned payload, so getting
+         * from the payload to its header stays a single subtraction */
+        const size_t align =
+            args->align > TR24SP_MIN_ALIGN ? args->align : TR24SP_MIN_ALIGN;
+        size_t payload = ((size_t)base + sizeof(tr24sp__s_prefix) +
+                          entry_size + align - 1) &
+                         ~(align - 1);
+        ptr = (tr24sp__s_meta_shared *)(payload - entry_size);
+        *((tr24sp__s_prefix *)ptr - 1) =
+            (tr24sp__s_prefix){ .base = base, .length = total_size };
+    }
+
     char *shifted = (char *)ptr + head_size;
     if(args->meta.size && args->meta.data)
         TR24_MEMCPY(shifted, args->meta.data, args->meta.size);
@@ -475,16 +2458,67 @@ static void *tr24sp__smalloc_impl(tr24sp__s_smalloc_args *args)
     size_t *sz = (size_t *)(shifted + aligned_metasize);
     *sz = head_size + aligned_metasize;
 
-    *(tr24sp__s_meta *)ptr = (tr24sp__s_meta){ .kind = args->kind,
+    *(tr24sp__s_meta *)ptr = (tr24sp__s_meta){ .kind = kind,
                                                .dtor = args->dtor,
-#ifndef NDEBUG
                                                .ptr = sz + 1
-#endif
+                                               TR24SP_META_STATS_INIT
     };
 
-    if(args->kind & TR24_SP_SHARED)
+    if((args->kind & (TR24_SP_SHARED | TR24_SP_WEAK)) ==
+       (TR24_SP_SHARED | TR24_SP_WEAK)) {
+        struct tr24sp__s_ctrl *ctrl =
+            (struct tr24sp__s_ctrl *)tr24sp__raw_alloc(sizeof(*ctrl));
+        if(ctrl == NULL) {
+            if(!region)
+                tr24sp__free_entry((tr24sp__s_meta *)ptr);
+            return NULL;
+        }
+        *ctrl = (struct tr24sp__s_ctrl){ .strong = 1, .weak = 1, .ptr = sz + 1 };
+        ((tr24sp__s_meta_weak *)ptr)->ctrl = ctrl;
+    } else if((args->kind & (TR24_SP_SHARED | TR24_SP_BIASED)) ==
+              (TR24_SP_SHARED | TR24_SP_BIASED)) {
+        tr24sp__s_meta_biased *biased = (tr24sp__s_meta_biased *)ptr;
+        biased->shared = 0;
+        biased->owner = tr24sp__brc_self();
+        biased->biased = 1;
+        biased->next = NULL;
+        if(biased->owner == NULL) {
+            if(!region)
+                tr24sp__free_entry((tr24sp__s_meta *)ptr);
+            return NULL;
+        }
+    } else if(kind & TR24_SP_SHARDED) {
+        tr24sp__s_meta_sharded *sharded = (tr24sp__s_meta_sharded *)ptr;
+        const size_t bytes = sizeof(tr24sp__s_shard) * TR24SP_SHARDS;
+        sharded->shards_base = tr24sp__raw_alloc(bytes + TR24SP_CACHE_LINE);
+        if(sharded->shards_base == NULL) {
+            tr24sp__free_entry((tr24sp__s_meta *)ptr);
+            return NULL;
+        }
+        sharded->shards =
+            (tr24sp__s_shard *)(((size_t)sharded->shards_base +
+                                 TR24SP_CACHE_LINE - 1) &
+                                ~(size_t)(TR24SP_CACHE_LINE - 1));
+        TR24_MEMSET(sharded->shards, 0, bytes);
+        sharded->ref_count = TR24SP_SHARD_BIAS + 1;
+    } else if(args->kind & TR24_SP_SHARED)
         ptr->ref_count = 1;
 
+    if(region && (args->dtor || kind & TR24_SP_WEAK)) {
+        tr24sp__s_region_dtor *d = (tr24sp__s_region_dtor *)tr24sp__region_alloc(
+            region, sizeof(tr24sp__s_region_dtor));
+        if(d == NULL)
+            return NULL;
+        *d = (tr24sp__s_region_dtor){
+            .next = region->dtors,
+            .meta = (tr24sp__s_meta *)ptr,
+            .ptr = sz + 1,
+        };
+        region->dtors = d;
+    }
+
+    tr24sp__stats_alloc(region ? NULL : &((tr24sp__s_meta *)ptr)->stats, kind,
+                        args->size);
     return sz + 1;
 }
 
@@ -496,76 +2530,959 @@ TR24_INLINE static void *tr24sp__smalloc_array(tr24sp__s_smalloc_args *args)
     char new_meta[size];
     tr24sp__s_meta_array *arr_meta = (tr24sp__s_meta_array *)((void *)new_meta);
     *arr_meta = (tr24sp__s_meta_array){
-        .size = args->size,
         .nmemb = args->nmemb,
+        .size = args->size,
+        .capacity = args->nmemb,
     };
-    TR24_MEMCPY(arr_meta + 1, args->meta.data, args->meta.size);
-#ifndef __cplusplus
-    return tr24sp__smalloc_impl(&(tr24sp__s_smalloc_args){
+    if(args->meta.size)
+        TR24_MEMCPY(arr_meta + 1, args->meta.data, args->meta.size);
+    tr24sp__s_smalloc_args array_args = {
+        TR24SP_SENTINEL
         .size = args->nmemb * args->size,
+        .nmemb = 0,
         .kind = (enum tr24sp__pointer)(args->kind | TR24_SP_ARRAY),
         .dtor = args->dtor,
         .meta = { &new_meta, size },
-    });
-#else
-    return tr24sp__smalloc_impl(
-        (tr24sp__s_smalloc_args *)tr24sp__cppabi_ref((tr24sp__s_smalloc_args){
-            .size = args->nmemb * args->size,
-            .kind = (enum tr24sp__pointer)(args->kind | TR24_SP_ARRAY),
-            .dtor = args->dtor,
-            .meta = { &new_meta, size },
-        }));
-#endif /* __cplusplus */
+        .align = args->align,
+        .bulk_dtor = NULL,
+    };
+    return tr24sp__smalloc_impl(&array_args);
+}
+
+/* from here on a bulk destructor is the destructor, told apart by kind */
+TR24_INLINE static tr24sp__s_smalloc_args *
+tr24sp__fold_bulk(tr24sp__s_smalloc_args *args, tr24sp__s_smalloc_args *copy)
+{
+    if(!args->bulk_dtor)
+        return args;
+    TR24_ASSERT(args->dtor == NULL);
+    *copy = *args;
+    copy->kind = (enum tr24sp__pointer)(copy->kind | TR24_SP_BULK);
+    copy->dtor = (tr24sp__f_destruct)(void (*)(void))copy->bulk_dtor;
+    copy->bulk_dtor = NULL;
+    return copy;
 }
 
 TR24_MALLOC_API
 void *tr24sp__smalloc(tr24sp__s_smalloc_args *args)
 {
+    tr24sp__s_smalloc_args bulk;
+    args = tr24sp__fold_bulk(args, &bulk);
     return (args->nmemb == 0 ? tr24sp__smalloc_impl :
                                tr24sp__smalloc_array)(args);
 }
 
+/* The header gets an anonymous page (or a few) of its own and the file is
+ * mapped right behind it, so the elements start on a page boundary and one
+ * munmap drops both. */
+void *tr24sp__mmap_arr(size_t type, const char *path, int flags,
+                       enum tr24sp__pointer kind)
+{
+#ifdef TR24SP_HAVE_MMAP
+    TR24_ASSERT(type > 0);
+    TR24_ASSERT(!(kind & (TR24_SP_WEAK | TR24_SP_BIASED)));
+    kind = (enum tr24sp__pointer)((kind & TR24_SP_SHARED) | TR24_SP_ARRAY |
+                                  TR24_SP_MAPPED | TR24_SP_FILE);
+
+    const int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return NULL;
+    struct stat st;
+    if(fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t head_size = tr24sp__head_size(kind);
+    const size_t metasize = tr24sp__align(sizeof(tr24sp__s_meta_array));
+    const size_t entry_size = head_size + metasize + sizeof(size_t);
+    const size_t header =
+        (sizeof(tr24sp__s_prefix) + entry_size + page - 1) & ~(page - 1);
+    const size_t file_size = (size_t)st.st_size;
+    const size_t length = header + ((file_size + page - 1) & ~(page - 1));
+
+    char *base = (char *)mmap(NULL, length, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    if(file_size) {
+        const int prot =
+            flags & TR24_MMAP_COPY ? PROT_READ | PROT_WRITE : PROT_READ;
+        const int share = flags & TR24_MMAP_COPY ? MAP_PRIVATE : MAP_SHARED;
+        if(mmap(base + header, file_size, prot, share | MAP_FIXED, fd, 0) ==
+           MAP_FAILED) {
+            const int error = errno;
+            munmap(base, length);
+            close(fd);
+            errno = error;
+            return NULL;
+        }
+    }
+    close(fd);
+
+#ifdef MADV_SEQUENTIAL
+    if(file_size && flags & TR24_MMAP_SEQUENTIAL)
+        madvise(base + header, file_size, MADV_SEQUENTIAL);
+    if(file_size && flags & TR24_MMAP_RANDOM)
+        madvise(base + header, file_size, MADV_RANDOM);
+    if(file_size && flags & TR24_MMAP_WILLNEED)
+        madvise(base + header, file_size, MADV_WILLNEED);
+#endif /* MADV_SEQUENTIAL */
+
+    char *ptr = base + header;
+    tr24sp__s_meta *meta = (tr24sp__s_meta *)(ptr - entry_size);
+    *((tr24sp__s_prefix *)meta - 1) =
+        (tr24sp__s_prefix){ .base = base, .length = length };
+    *meta = (tr24sp__s_meta){ .kind = kind,
+                              .dtor = NULL,
+                              .ptr = ptr
+                              TR24SP_META_STATS_INIT
+    };
+    if(kind & TR24_SP_SHARED)
+        ((tr24sp__s_meta_shared *)meta)->ref_count = 1;
+    *(tr24sp__s_meta_array *)((char *)meta + head_size) =
+        (tr24sp__s_meta_array){
+            .nmemb = file_size / type,
+            .size = type,
+            .capacity = file_size / type,
+        };
+    *((size_t *)ptr - 1) = head_size + metasize;
+    tr24sp__stats_alloc(&meta->stats, kind, file_size);
+    return ptr;
+#else
+    (void)type;
+    (void)path;
+    (void)flags;
+    (void)kind;
+    errno = ENOSYS;
+    return NULL;
+#endif /* TR24SP_HAVE_MMAP */
+}
+
+#define TR24SP_BRC_MERGED ((intptr_t)1)
+#define TR24SP_BRC_QUEUED ((intptr_t)2)
+#define TR24SP_BRC_ONE ((intptr_t)4)
+#define TR24SP_BRC_DEAD ((void *)1)
+
+static __thread tr24sp__s_brc_queue *tr24sp__brc_queue;
+static pthread_key_t tr24sp__brc_key;
+static pthread_once_t tr24sp__brc_once = PTHREAD_ONCE_INIT;
+
+TR24_INLINE static intptr_t tr24sp__brc_count(intptr_t shared)
+{
+    /* arithmetic shift, the count can be negative */
+    return shared >> 2;
+}
+
+/* folds the owner's count into the shared one, after which everybody counts
+ * atomically. The caller must be the owner, or the owner must be gone. */
+static void tr24sp__brc_merge(tr24sp__s_meta_biased *meta, void *ptr)
+{
+    const intptr_t biased = (intptr_t)meta->biased;
+    meta->biased = 0;
+    meta->owner = NULL;
+
+    intptr_t old_shared, new_shared;
+    do {
+        old_shared = meta->shared;
+        new_shared = (old_shared + biased * TR24SP_BRC_ONE) | TR24SP_BRC_MERGED;
+        new_shared &= ~TR24SP_BRC_QUEUED;
+    } while(!__sync_bool_compare_and_swap(&meta->shared, old_shared,
+                                          new_shared));
+    if(tr24sp__brc_count(new_shared) == 0)
+        tr24sp__dealloc_entry((tr24sp__s_meta *)meta, ptr);
+}
+
+static void tr24sp__brc_merge_list(void *ptr)
+{
+    while(ptr && ptr != TR24SP_BRC_DEAD) {
+        tr24sp__s_meta_biased *meta =
+            (tr24sp__s_meta_biased *)tr24sp__get_meta(ptr);
+        void *next = meta->next;
+        tr24sp__brc_merge(meta, ptr);
+        ptr = next;
+    }
+}
+
+static void tr24sp__brc_thread_exit(void *arg)
+{
+    /* queues outlive their threads, later pushes see DEAD and merge on
+     * the spot since nobody can touch the biased counts anymore */
+    tr24sp__s_brc_queue *queue = (tr24sp__s_brc_queue *)arg;
+    tr24sp__brc_merge_list(__sync_lock_test_and_set(&queue->head,
+                                                    TR24SP_BRC_DEAD));
+    tr24sp__brc_queue = NULL;
+}
+
+static void tr24sp__brc_init(void)
+{
+    pthread_key_create(&tr24sp__brc_key, tr24sp__brc_thread_exit);
+}
+
+static tr24sp__s_brc_queue *tr24sp__brc_self(void)
+{
+    if(__builtin_expect(tr24sp__brc_queue == NULL, 0)) {
+        tr24sp__s_brc_queue *queue =
+            (tr24sp__s_brc_queue *)TR24_MALLOC(sizeof(tr24sp__s_brc_queue));
+        if(queue == NULL)
+            return NULL;
+        queue->head = NULL;
+        pthread_once(&tr24sp__brc_once, tr24sp__brc_init);
+        pthread_setspecific(tr24sp__brc_key, queue);
+        tr24sp__brc_queue = queue;
+    }
+    return tr24sp__brc_queue;
+}
+
+void tr24sp__brc_drain(void)
+{
+    tr24sp__s_brc_queue *queue = tr24sp__brc_queue;
+    if(queue && queue->head)
+        tr24sp__brc_merge_list(__sync_lock_test_and_set(&queue->head, NULL));
+}
+
+TR24_INLINE static int tr24sp__brc_owned(tr24sp__s_meta_biased *meta)
+{
+    return meta->owner != NULL && meta->owner == tr24sp__brc_queue;
+}
+
+static void tr24sp__brc_sref(tr24sp__s_meta_biased *meta)
+{
+    if(tr24sp__brc_owned(meta)) {
+        ++meta->biased;
+        return;
+    }
+    __sync_fetch_and_add(&meta->shared, TR24SP_BRC_ONE);
+}
+
+/* returns zero once the object has to be destroyed */
+static size_t tr24sp__brc_sfree(tr24sp__s_meta_biased *meta, void *ptr)
+{
+    intptr_t old_shared, new_shared;
+    /* settling the queue can merge this very object, check again after */
+    if(tr24sp__brc_owned(meta))
+        tr24sp__brc_drain();
+    if(tr24sp__brc_owned(meta)) {
+        if(--meta->biased)
+            return 1;
+        meta->owner = NULL;
+        do {
+            old_shared = meta->shared;
+            new_shared = old_shared | TR24SP_BRC_MERGED;
+        } while(!__sync_bool_compare_and_swap(&meta->shared, old_shared,
+                                              new_shared));
+        return tr24sp__brc_count(new_shared) != 0 ||
+               new_shared & TR24SP_BRC_QUEUED;
+    }
+
+    int queue;
+    do {
+        old_shared = meta->shared;
+        new_shared = old_shared - TR24SP_BRC_ONE;
+        queue = tr24sp__brc_count(new_shared) < 0 &&
+                !(new_shared & TR24SP_BRC_QUEUED);
+        if(queue)
+            new_shared |= TR24SP_BRC_QUEUED;
+    } while(!__sync_bool_compare_and_swap(&meta->shared, old_shared,
+                                          new_shared));
+
+    if(queue) {
+        /* we dropped a reference the owner counted, let it settle that */
+        tr24sp__s_brc_queue *owner = meta->owner;
+        void *head;
+        do {
+            head = owner->head;
+            if(head == TR24SP_BRC_DEAD) {
+                tr24sp__brc_merge(meta, ptr);
+                return 1;
+            }
+            meta->next = head;
+        } while(!__sync_bool_compare_and_swap(&owner->head, head, ptr));
+        return 1;
+    }
+
+    return tr24sp__brc_count(new_shared) != 0 ||
+           !(new_shared & TR24SP_BRC_MERGED) ||
+           new_shared & TR24SP_BRC_QUEUED;
+}
+
 void tr24sp__sfree(void *ptr)
 {
     if(!ptr)
         return;
 
+    if(tr24sp__is_compact(ptr)) {
+        tr24sp__compact_sfree(ptr);
+        return;
+    }
+
     TR24_ASSERT((size_t)ptr == tr24sp__align((size_t)ptr));
     tr24sp__s_meta *meta = tr24sp__get_meta(ptr);
     TR24_ASSERT(meta->ptr == ptr);
+    if(meta->kind & TR24_SP_SHARED)
+        tr24sp__stats_ref(ref_dec);
+
+    if(meta->kind & TR24_SP_WEAK) {
+        tr24sp__s_meta_weak *weak = (tr24sp__s_meta_weak *)meta;
+        struct tr24sp__s_ctrl *ctrl = weak->ctrl;
+        if(atomic_decrement(&ctrl->strong))
+            return;
+        if(meta->kind & TR24_SP_REGION)
+            weak->ctrl = NULL;
+        tr24sp__dealloc_entry(meta, ptr);
+        tr24sp__weak_release(ctrl);
+        return;
+    }
 
-    if(meta->kind & TR24_SP_SHARED &&
-       atomic_decrement(&((tr24sp__s_meta_shared *)meta)->ref_count))
+    if(meta->kind & TR24_SP_BIASED) {
+        if(tr24sp__brc_sfree((tr24sp__s_meta_biased *)meta, ptr))
+            return;
+    } else if(meta->kind & TR24_SP_SHARDED) {
+        if(tr24sp__shard_sfree((tr24sp__s_meta_sharded *)meta))
+            return;
+    } else if(meta->kind & TR24_SP_LOCAL) {
+        if(local_add(&((tr24sp__s_meta_shared *)meta)->ref_count, 0, -1))
+            return;
+    } else if(meta->kind & TR24_SP_SHARED &&
+              atomic_decrement(&((tr24sp__s_meta_shared *)meta)->ref_count))
         return;
 
     tr24sp__dealloc_entry(meta, ptr);
 }
 
-void *tr24sp__srealloc(size_t type, void *ptr, size_t size)
+/* the entries are laid out like aligned ones, a prefix pointing at the
+ * slab right in front of each header */
+size_t tr24sp__smalloc_batch(tr24sp__s_smalloc_args *args, size_t n,
+                             void **out)
+{
+    if(n == 0 || !args->size)
+        return 0;
+    tr24sp__s_smalloc_args bulk;
+    args = tr24sp__fold_bulk(args, &bulk);
+
+    enum tr24sp__pointer kind =
+        (enum tr24sp__pointer)(args->kind & ~TR24_SP_COMPACT);
+    if(args->nmemb || args->align > TR24SP_MIN_ALIGN ||
+       kind & (TR24_SP_WEAK | TR24_SP_BIASED | TR24_SP_HUGE |
+               TR24_SP_SHARDED) ||
+       tr24sp__region_current) {
+        for(size_t i = 0; i < n; ++i) {
+            if(i)
+                tr24sp__stats_inherit(tr24sp__stats_of(out[0]));
+            out[i] = tr24sp__smalloc(args);
+            if(out[i] == NULL) {
+                tr24sp__sfree_batch(out, i);
+                return 0;
+            }
+            TR24_MEMSET(out[i], 0,
+                        args->size * (args->nmemb ? args->nmemb : 1));
+        }
+        return n;
+    }
+
+    if(!(kind & TR24_SP_SHARED) && args->size >= TR24SP_PROMOTE_THRESHOLD)
+        kind = (enum tr24sp__pointer)(kind | TR24_SP_PROMOTABLE);
+    kind = (enum tr24sp__pointer)(kind | TR24_SP_BATCH);
+
+    const size_t aligned_metasize = tr24sp__align(args->meta.size);
+    const size_t head_size = tr24sp__head_size(kind);
+    const size_t stride = sizeof(tr24sp__s_prefix) + head_size +
+                          aligned_metasize + sizeof(size_t) +
+                          tr24sp__align(args->size);
+    if(stride > (SIZE_MAX - sizeof(tr24sp__s_batch)) / n)
+        return 0;
+    tr24sp__s_batch *slab = (tr24sp__s_batch *)tr24sp__alloc_entry(
+        sizeof(tr24sp__s_batch) + stride * n);
+    if(slab == NULL)
+        return 0;
+    slab->live = n;
+
+    char *entry = (char *)(slab + 1);
+    for(size_t i = 0; i < n; ++i, entry += stride) {
+        *(tr24sp__s_prefix *)entry =
+            (tr24sp__s_prefix){ .base = slab, .length = stride };
+        tr24sp__s_meta_shared *meta =
+            (tr24sp__s_meta_shared *)(entry + sizeof(tr24sp__s_prefix));
+        char *shifted = (char *)meta + head_size;
+        if(args->meta.size && args->meta.data)
+            TR24_MEMCPY(shifted, args->meta.data, args->meta.size);
+
+        size_t *sz = (size_t *)(shifted + aligned_metasize);
+        *sz = head_size + aligned_metasize;
+        *(tr24sp__s_meta *)meta = (tr24sp__s_meta){ .kind = kind,
+                                                    .dtor = args->dtor,
+                                                    .ptr = sz + 1
+                                                    TR24SP_META_STATS_INIT
+        };
+        if(kind & TR24_SP_SHARED)
+            meta->ref_count = 1;
+        TR24_MEMSET(sz + 1, 0, args->size);
+
+        if(i)
+            tr24sp__stats_inherit(tr24sp__stats_of(out[0]));
+        tr24sp__stats_alloc(&((tr24sp__s_meta *)meta)->stats, kind,
+                            args->size);
+        out[i] = sz + 1;
+    }
+    return n;
+}
+
+void tr24sp__sfree_batch(void **ptrs, size_t n)
+{
+    tr24sp__s_batch *slab = NULL;
+    size_t released = 0;
+    for(size_t i = 0; i < n; ++i) {
+        void *ptr = ptrs[i];
+        ptrs[i] = NULL;
+        tr24sp__s_meta *meta =
+            ptr && !tr24sp__is_compact(ptr) ? tr24sp__get_meta(ptr) : NULL;
+        if(meta == NULL ||
+           (meta->kind & (TR24_SP_BATCH | TR24_SP_SHARED | TR24_SP_DEFER)) !=
+               TR24_SP_BATCH) {
+            tr24sp__sfree(ptr);
+            continue;
+        }
+
+        /* unique members only put off the slab count */
+        TR24_ASSERT(meta->ptr == ptr);
+        if(meta->dtor)
+            tr24sp__run_dtor(meta, ptr);
+        tr24sp__stats_free(&meta->stats, meta->kind);
+        tr24sp__s_batch *owner =
+            (tr24sp__s_batch *)((tr24sp__s_prefix *)meta - 1)->base;
+        if(owner != slab) {
+            tr24sp__batch_release(slab, released);
+            slab = owner;
+            released = 0;
+        }
+        ++released;
+    }
+    tr24sp__batch_release(slab, released);
+}
+
+void tr24sp__sdiscard(void *ptr)
+{
+    if(!ptr)
+        return;
+    if(tr24sp__is_compact(ptr))
+        *tr24sp__compact_word(ptr) &= ~TR24SP_COMPACT_DTOR_MASK;
+    else
+        tr24sp__get_meta(ptr)->dtor = NULL;
+    tr24sp__sretire(ptr);
+}
+
+void tr24sp__sretire(void *ptr)
+{
+    if(!ptr)
+        return;
+    if(tr24sp__is_compact(ptr) ||
+       !(tr24sp__get_meta(ptr)->kind & TR24_SP_SHARDED)) {
+        tr24sp__sfree(ptr);
+        return;
+    }
+
+    tr24sp__s_meta_sharded *meta =
+        (tr24sp__s_meta_sharded *)tr24sp__get_meta(ptr);
+    TR24_ASSERT(meta->ptr == ptr);
+    tr24sp__stats_ref(ref_dec);
+    /* a dead shard sends every sref and sfree made on it to ref_count, so
+     * each one is counted either in the fold or there */
+    for(size_t i = 0; i < TR24SP_SHARDS; ++i) {
+        intptr_t count;
+        do {
+            count = meta->shards[i].count;
+            TR24_ASSERT(count >= TR24SP_SHARD_DEAD / 2);
+        } while(!__sync_bool_compare_and_swap(&meta->shards[i].count, count,
+                                              TR24SP_SHARD_DEAD));
+        __sync_fetch_and_add(&meta->ref_count, (size_t)count);
+    }
+    if(__sync_sub_and_fetch(&meta->ref_count, TR24SP_SHARD_BIAS + 1) == 0)
+        tr24sp__dealloc_entry((tr24sp__s_meta *)meta, ptr);
+}
+
+size_t tr24sp__drain(void)
+{
+    size_t count = 0;
+    void *list;
+    /* destructors may queue more objects, keep going until it stays empty */
+    while((list = __sync_lock_test_and_set(&tr24sp__defer_head, NULL))) {
+        /* the queue is a stack, turn it around to release oldest first */
+        void *ptr = NULL;
+        while(list) {
+            tr24sp__s_meta *meta = tr24sp__get_meta(list);
+            void *next = meta->ptr;
+            meta->ptr = ptr;
+            ptr = list;
+            list = next;
+        }
+        while(ptr) {
+            tr24sp__s_meta *meta = tr24sp__get_meta(ptr);
+            void *next = meta->ptr;
+#ifndef NDEBUG
+            meta->ptr = ptr;
+#endif
+            tr24sp__release_entry(meta, ptr);
+            ptr = next;
+            ++count;
+        }
+    }
+    return count;
+}
+
+/* 0 stopped, 1 running, 2 being stopped */
+static volatile int tr24sp__reclaimer_state;
+static pthread_t tr24sp__reclaimer;
+
+static void *tr24sp__reclaim(void *arg)
+{
+    (void)arg;
+    const struct timespec interval = {
+        .tv_sec = TR24SP_RECLAIM_INTERVAL / 1000000,
+        .tv_nsec = TR24SP_RECLAIM_INTERVAL % 1000000 * 1000,
+    };
+    while(tr24sp__reclaimer_state == 1)
+        if(!tr24sp__drain())
+            nanosleep(&interval, NULL);
+    tr24sp__drain();
+    return NULL;
+}
+
+int tr24sp__reclaimer_start(void)
+{
+    if(!__sync_bool_compare_and_swap(&tr24sp__reclaimer_state, 0, 1))
+        return 0;
+    if(pthread_create(&tr24sp__reclaimer, NULL, tr24sp__reclaim, NULL)) {
+        tr24sp__reclaimer_state = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void tr24sp__reclaimer_stop(void)
+{
+    if(!__sync_bool_compare_and_swap(&tr24sp__reclaimer_state, 1, 2))
+        return;
+    pthread_join(tr24sp__reclaimer, NULL);
+    tr24sp__reclaimer_state = 0;
+}
+
+tr24_weak_ptr tr24sp__weak_ref(void *ptr)
 {
     if(!ptr)
         return NULL;
-    TR24_ASSERT((size_t)ptr == tr24sp__align((size_t)ptr));
+    TR24_ASSERT(!tr24sp__is_compact(ptr));
     tr24sp__s_meta *meta = tr24sp__get_meta(ptr);
     TR24_ASSERT(meta->ptr == ptr);
-    void *newptr = tr24sp__smalloc_m(type, size / type, meta->kind, meta->dtor);
-    TR24_MEMCPY(newptr, ptr, size);
-    tr24sp__sfree(ptr);
-    return newptr;
+    TR24_ASSERT(meta->kind & TR24_SP_WEAK);
+    struct tr24sp__s_ctrl *ctrl = ((tr24sp__s_meta_weak *)meta)->ctrl;
+    atomic_increment(&ctrl->weak);
+    return ctrl;
 }
 
-#if defined(TR24_CPP_USE_C_ABI) && defined(__cplusplus)
+tr24_weak_ptr tr24sp__weak_copy(tr24_weak_ptr weak)
+{
+    if(weak)
+        atomic_increment(&weak->weak);
+    return weak;
 }
-#endif /* TR24_CPP_USE_C_ABI & __cplusplus */
 
-#endif /* TR24_SMARTPTR_H_ */
+void *tr24sp__weak_lock(tr24_weak_ptr weak)
+{
+    if(!weak)
+        return NULL;
+    size_t old_count;
+    do {
+        old_count = weak->strong;
+        if(old_count == 0)
+            return NULL;
+    } while(!__sync_bool_compare_and_swap(&weak->strong, old_count,
+                                          old_count + 1));
+    return weak->ptr;
+}
+
+int tr24sp__weak_expired(tr24_weak_ptr weak)
+{
+    return !weak || weak->strong == 0;
+}
+
+void tr24sp__weak_release(tr24_weak_ptr weak)
+{
+    if(weak && !atomic_decrement(&weak->weak))
+        tr24sp__raw_dealloc(weak);
+}
+
+/* pointers live in the low bits of the slot, the loads in flight above */
+#if UINTPTR_MAX == UINT64_MAX
+#define TR24SP_AS_SHIFT 48
+#else
+#define TR24SP_AS_SHIFT 32
+#endif /* UINTPTR_MAX */
+#define TR24SP_AS_ONE ((uint64_t)1 << TR24SP_AS_SHIFT)
+#define TR24SP_AS_PTR(word) ((void *)(uintptr_t)((word) & (TR24SP_AS_ONE - 1)))
+
+/* hands the loads still counted in `word` over to the object itself */
+static void *tr24sp__atomic_shared_settle(uint64_t word)
+{
+    void *ptr = TR24SP_AS_PTR(word);
+    for(uint64_t n = word >> TR24SP_AS_SHIFT; n > 0; --n)
+        tr24sp__sref(ptr);
+    return ptr;
+}
+
+void *tr24sp__atomic_shared_load(tr24_atomic_shared *slot)
+{
+    uint64_t word;
+    for(;;) {
+        word = slot->word;
+        if(TR24SP_AS_PTR(word) == NULL)
+            return NULL;
+        /* wait for a free count when every one is taken */
+        if(word >> TR24SP_AS_SHIFT == UINT64_MAX >> TR24SP_AS_SHIFT)
+            continue;
+        if(__sync_bool_compare_and_swap(&slot->word, word,
+                                        word + TR24SP_AS_ONE))
+            break;
+    }
+
+    void *ptr = tr24sp__sref(TR24SP_AS_PTR(word));
+
+    /* give the count back, unless it was already handed to the object, then
+     * drop the reference it turned into. The reference just taken keeps the
+     * object alive, so the same address means the same object. */
+    for(;;) {
+        word = slot->word;
+        if(TR24SP_AS_PTR(word) != ptr || word < TR24SP_AS_ONE) {
+            tr24sp__sfree(ptr);
+            break;
+        }
+        if(__sync_bool_compare_and_swap(&slot->word, word,
+                                        word - TR24SP_AS_ONE))
+            break;
+    }
+    return ptr;
+}
+
+void *tr24sp__atomic_shared_exchange(tr24_atomic_shared *slot, void *ptr)
+{
+    if(ptr)
+        tr24sp__sref(ptr);
+    TR24_ASSERT((uint64_t)(uintptr_t)ptr < TR24SP_AS_ONE);
+    uint64_t word;
+    do
+        word = slot->word;
+    while(!__sync_bool_compare_and_swap(&slot->word, word,
+                                        (uint64_t)(uintptr_t)ptr));
+    return tr24sp__atomic_shared_settle(word);
+}
+
+void tr24sp__atomic_shared_store(tr24_atomic_shared *slot, void *ptr)
+{
+    void *old = tr24sp__atomic_shared_exchange(slot, ptr);
+    if(old)
+        tr24sp__sfree(old);
+}
+
+int tr24sp__atomic_shared_compare_exchange(tr24_atomic_shared *slot,
+                                           void **expected, void *desired)
+{
+    if(desired)
+        tr24sp__sref(desired);
+    TR24_ASSERT((uint64_t)(uintptr_t)desired < TR24SP_AS_ONE);
+    uint64_t word;
+    for(;;) {
+        word = slot->word;
+        if(TR24SP_AS_PTR(word) != *expected)
+            break;
+        if(__sync_bool_compare_and_swap(&slot->word, word,
+                                        (uint64_t)(uintptr_t)desired)) {
+            void *old = tr24sp__atomic_shared_settle(word);
+            if(old)
+                tr24sp__sfree(old);
+            return 1;
+        }
+    }
+
+    if(desired)
+        tr24sp__sfree(desired);
+    if(*expected)
+        tr24sp__sfree(*expected);
+    *expected = tr24sp__atomic_shared_load(slot);
+    return 0;
+}
+
+/* the kinds smalloc works out by itself */
+#define TR24SP_KIND_INTERNAL                                            \
+    (TR24_SP_ARRAY | TR24_SP_REGION | TR24_SP_ALIGNED | TR24_SP_MAPPED | \
+     TR24_SP_FILE | TR24_SP_BATCH)
+
+/* reallocates the whole entry, header included, to hold `size` payload
+ * bytes. Only done when nothing else points into the entry. */
+static void *tr24sp__grow_entry(tr24sp__s_meta *meta, void *ptr, size_t size)
+{
+    if(tr24sp__is_compact(ptr)) {
+        const uint64_t word = *tr24sp__compact_word(ptr);
+        if(!(word & TR24SP_COMPACT_ARRAY) ||
+           (word & TR24SP_COMPACT_SHARED && word >> 32 != 1))
+            return NULL;
+        char *base = (char *)tr24sp__compact_meta(ptr);
+        if(base == NULL)
+            base = (char *)tr24sp__compact_word(ptr);
+        base -= TR24SP_COMPACT_STATS_SIZE;
+        const size_t offset = (char *)ptr - base;
+        char *entry =
+            (char *)tr24sp__raw_realloc(base, offset + tr24sp__align(size));
+        if(entry == NULL)
+            return NULL;
+        tr24sp__stats_resize(tr24sp__stats_of(entry + offset),
+                             TR24_SP_ARRAY, size);
+        return entry + offset;
+    }
+    if(meta->kind & (TR24_SP_REGION | TR24_SP_ALIGNED | TR24_SP_WEAK |
+                     TR24_SP_BIASED | TR24_SP_FILE | TR24_SP_BATCH) ||
+       !(meta->kind & TR24_SP_ARRAY))
+        return NULL;
+    if(meta->kind & TR24_SP_SHARED &&
+       ((tr24sp__s_meta_shared *)meta)->ref_count != 1)
+        return NULL;
 
+    if(meta->kind & TR24_SP_MAPPED) {
+#ifdef MREMAP_MAYMOVE
+        if(meta->kind & TR24_SP_HUGE)
+            return NULL;
+        tr24sp__s_prefix *prefix = (tr24sp__s_prefix *)meta - 1;
+        char *base = (char *)prefix->base;
+        const size_t offset = (char *)ptr - base;
+        const size_t length = offset + tr24sp__align(size);
+        char *entry = (char *)mremap(base, prefix->length, length,
+                                     MREMAP_MAYMOVE);
+        if(entry == MAP_FAILED)
+            return NULL;
+        meta = (tr24sp__s_meta *)(entry + ((char *)meta - base));
+        prefix = (tr24sp__s_prefix *)meta - 1;
+        *prefix = (tr24sp__s_prefix){ .base = entry, .length = length };
+#ifndef NDEBUG
+        meta->ptr = entry + offset;
+#endif
+        tr24sp__stats_resize(&meta->stats, TR24_SP_ARRAY, size);
+        return entry + offset;
 #else
-#if !defined(TR24_CPP_USE_C_ABI)
-#warning just use std::unique_ptr<T> and std::shared_ptr<T>
-#warning if you need to use the C api for smart pointers define TR24_CPP_USE_C_ABI
+        return NULL;
+#endif /* MREMAP_MAYMOVE */
+    }
+
+    const size_t offset = *((size_t *)ptr - 1) + sizeof(size_t);
+    char *entry = (char *)tr24sp__raw_realloc(meta, offset + tr24sp__align(size));
+    if(entry == NULL)
+        return NULL;
+#ifndef NDEBUG
+    ((tr24sp__s_meta *)entry)->ptr = entry + offset;
 #endif
+    tr24sp__stats_resize(&((tr24sp__s_meta *)entry)->stats, TR24_SP_ARRAY,
+                         size);
+    return entry + offset;
+}
+
+/* whether `ptr` is the last reference to its object, only meaningful while
+ * nobody else can sref it */
+static int tr24sp__sole_ref(tr24sp__s_meta *meta, void *ptr)
+{
+    if(meta == NULL) {
+        const uint64_t word = *tr24sp__compact_word(ptr);
+        return !(word & TR24SP_COMPACT_SHARED) || word >> 32 == 1;
+    }
+    if(!(meta->kind & TR24_SP_SHARED))
+        return 1;
+    if(meta->kind & TR24_SP_WEAK)
+        return ((tr24sp__s_meta_weak *)meta)->ctrl->strong == 1;
+    if(meta->kind & TR24_SP_BIASED) {
+        tr24sp__s_meta_biased *biased = (tr24sp__s_meta_biased *)meta;
+        intptr_t count = tr24sp__brc_count(biased->shared);
+        if(tr24sp__brc_owned(biased))
+            count += (intptr_t)biased->biased;
+        else if(biased->owner != NULL)
+            return 0;
+        return count == 1;
+    }
+    if(meta->kind & TR24_SP_SHARDED) {
+        tr24sp__s_meta_sharded *sharded = (tr24sp__s_meta_sharded *)meta;
+        size_t count = sharded->ref_count - TR24SP_SHARD_BIAS;
+        for(size_t i = 0; i < TR24SP_SHARDS; ++i)
+            count += (size_t)sharded->shards[i].count;
+        return count == 1;
+    }
+    return ((tr24sp__s_meta_shared *)meta)->ref_count == 1;
+}
+
+/* the slow path, a new entry with the same kind, dtor, alignment and user
+ * meta. The old elements are moved over, so their dtors don't run twice.
+ * Shared entries with a dtor can only be moved by their last owner, the
+ * other references would destroy the same elements again. `meta` is NULL
+ * for compact pointers. */
+static void *tr24sp__move_entry(tr24sp__s_meta *meta, void *ptr,
+                                size_t type, size_t nmemb, size_t capacity)
+{
+    int kind;
+    tr24sp__f_destruct dtor;
+    size_t metasize;
+    if(tr24sp__is_compact(ptr)) {
+        const uint64_t word = *tr24sp__compact_word(ptr);
+        kind = tr24sp__compact_kind(word);
+        dtor = tr24sp__compact_dtor(word);
+        metasize = word & TR24SP_COMPACT_META ? *((size_t *)ptr - 2) : 0;
+    } else {
+        kind = meta->kind;
+        dtor = meta->dtor;
+        metasize = *((size_t *)ptr - 1) -
+                   tr24sp__head_size((enum tr24sp__pointer)kind);
+    }
+    if(dtor && !tr24sp__sole_ref(meta, ptr))
+        return NULL;
+
+    tr24sp__s_meta_array *arr_meta =
+        kind & TR24_SP_ARRAY ?
+            (tr24sp__s_meta_array *)tr24sp__get_smart_ptr_meta(ptr) :
+            NULL;
+    const size_t user_meta_size =
+        arr_meta ? metasize - sizeof(tr24sp__s_meta_array) : 0;
+    const size_t align =
+        kind & TR24_SP_ALIGNED ? (size_t)ptr & -(size_t)ptr : 0;
+
+    tr24sp__s_smalloc_args args = {
+        TR24SP_SENTINEL
+        .size = type,
+        .nmemb = capacity,
+        .kind = (enum tr24sp__pointer)(kind & ~TR24SP_KIND_INTERNAL),
+        .dtor = dtor,
+        .meta = { arr_meta ? arr_meta + 1 : NULL, user_meta_size },
+        .align = align > 4096 ? 4096 : align,
+        .bulk_dtor = NULL,
+    };
+    tr24sp__stats_inherit(tr24sp__stats_of(ptr));
+    void *newptr = tr24sp__smalloc(&args);
+    if(newptr == NULL)
+        return NULL;
+
+    /* plain pointers don't know their size, they hold a single `type` */
+    const size_t old_size = arr_meta ? arr_meta->nmemb * arr_meta->size : type;
+    const size_t new_size = capacity ? nmemb * type : type;
+    TR24_MEMCPY(newptr, ptr, old_size < new_size ? old_size : new_size);
+    if(capacity)
+        ((tr24sp__s_meta_array *)tr24sp__get_smart_ptr_meta(newptr))->nmemb =
+            nmemb;
+
+    if(meta)
+        meta->dtor = NULL;
+    else
+        *tr24sp__compact_word(ptr) &= ~TR24SP_COMPACT_DTOR_MASK;
+    if(kind & TR24_SP_SHARDED)
+        tr24sp__sretire(ptr);
+    else
+        tr24sp__sfree(ptr);
+    return newptr;
+}
+
+void *tr24sp__srealloc(size_t type, void *ptr, size_t size)
+{
+    if(!ptr)
+        return NULL;
+    TR24_ASSERT((size_t)ptr == tr24sp__align((size_t)ptr));
+    tr24sp__s_meta *meta = NULL;
+    int is_array;
+    if(tr24sp__is_compact(ptr))
+        is_array = (*tr24sp__compact_word(ptr) & TR24SP_COMPACT_ARRAY) != 0;
+    else {
+        meta = tr24sp__get_meta(ptr);
+        TR24_ASSERT(meta->ptr == ptr);
+        is_array = (meta->kind & TR24_SP_ARRAY) != 0;
+    }
+
+    if(is_array &&
+       ((tr24sp__s_meta_array *)tr24sp__get_smart_ptr_meta(ptr))->size ==
+           type) {
+        void *newptr = tr24sp__grow_entry(meta, ptr, size);
+        if(newptr) {
+            tr24sp__s_meta_array *arr_meta =
+                (tr24sp__s_meta_array *)tr24sp__get_smart_ptr_meta(newptr);
+            arr_meta->nmemb = size / type;
+            arr_meta->capacity = size / type;
+            return newptr;
+        }
+    }
+
+    return tr24sp__move_entry(meta, ptr, type, size / type, size / type);
+}
+
+void *tr24sp__vec_create(size_t type, size_t capacity,
+                         enum tr24sp__pointer kind, tr24sp__f_destruct dtor)
+{
+    if(capacity == 0)
+        capacity = 1;
+    tr24sp__s_smalloc_args args = {
+        TR24SP_SENTINEL
+        .size = type,
+        .nmemb = capacity,
+        .kind = kind,
+        .dtor = dtor,
+        .meta = { NULL, 0 },
+        .align = 0,
+        .bulk_dtor = NULL,
+    };
+    void *ptr = tr24sp__smalloc(&args);
+    if(ptr)
+        ((tr24sp__s_meta_array *)tr24sp__get_smart_ptr_meta(ptr))->nmemb = 0;
+    return ptr;
+}
+
+void *tr24sp__vec_reserve(void *ptr, size_t capacity)
+{
+    tr24sp__s_meta_array *arr_meta =
+        (tr24sp__s_meta_array *)tr24sp__get_smart_ptr_meta(ptr);
+    if(capacity <= arr_meta->capacity)
+        return ptr;
+
+    tr24sp__s_meta *meta =
+        tr24sp__is_compact(ptr) ? NULL : tr24sp__get_meta(ptr);
+    const size_t type = arr_meta->size, nmemb = arr_meta->nmemb;
+    void *newptr = tr24sp__grow_entry(meta, ptr, capacity * type);
+    if(newptr == NULL)
+        newptr = tr24sp__move_entry(meta, ptr, type, nmemb, capacity);
+    if(newptr == NULL)
+        return ptr;
+    ((tr24sp__s_meta_array *)tr24sp__get_smart_ptr_meta(newptr))->capacity =
+        capacity;
+    return newptr;
+}
+
+void *tr24sp__vec_push_slot(void **ptr)
+{
+    tr24sp__s_meta_array *arr_meta =
+        (tr24sp__s_meta_array *)tr24sp__get_smart_ptr_meta(*ptr);
+    if(arr_meta->nmemb == arr_meta->capacity) {
+        void *newptr = tr24sp__vec_reserve(*ptr, arr_meta->capacity * 2);
+        arr_meta = (tr24sp__s_meta_array *)tr24sp__get_smart_ptr_meta(newptr);
+        *ptr = newptr;
+        if(arr_meta->nmemb == arr_meta->capacity)
+            return NULL;
+    }
+    return (char *)*ptr + arr_meta->size * arr_meta->nmemb++;
+}
+
+void *tr24sp__vec_pop_slot(void *ptr)
+{
+    tr24sp__s_meta_array *arr_meta =
+        (tr24sp__s_meta_array *)tr24sp__get_smart_ptr_meta(ptr);
+    TR24_ASSERT(arr_meta->nmemb > 0);
+    return (char *)ptr + arr_meta->size * --arr_meta->nmemb;
+}
+
+#ifdef __cplusplus
+}
 #endif /* __cplusplus */
+
+#endif /* TR24_SMARTPTR_IMPL */
 /*
 This is free and unencumbered software released into the public domain.
 